@@ -0,0 +1,248 @@
+/* Times PosInt's main operations over a sweep of operand sizes and
+ * writes the results to standard output, as JSON or (given "csv" as
+ * the argument) as CSV, for comparing one build against another.
+ * Run it through "make bench".
+ *
+ * Each operation is warmed up first, then timed in a number of
+ * samples, each of enough repetitions to take about a millisecond.
+ * The minimum, median and 10th and 90th percentiles of the time per
+ * operation across the samples are reported, in nanoseconds.
+ */
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include "posint.h"
+#include "fixedposint.h"
+using namespace std;
+
+// Samples taken for each operation and size
+static const int samples = 11;
+
+// Time spent on warm-up, and the least time for one sample, in ns
+static const double warmupTime = 20e6;
+static const double sampleTime = 1e6;
+
+// The operands for one operation, of len digits
+struct Operands {
+  int len;
+  PosInt a, b, n;
+  string text;
+};
+
+// Sets x to a random number of (at most) len digits
+static void randomDigits (PosInt& x, int len) {
+  PosInt bound(1);
+  bound <<= 64*len;
+  x.rand(bound);
+}
+
+// One operation to time: it is given operands of len digits by setup,
+// and run does it once. Sizes go up to maxLen digits.
+struct Benchmark {
+  const char* name;
+  int maxLen;
+  void (*setup) (Operands& ops, int len);
+  void (*run) (const Operands& ops);
+};
+
+static void setupTwo (Operands& ops, int len) {
+  randomDigits(ops.a, len);
+  randomDigits(ops.b, len);
+}
+
+// A dividend twice the length of the divisor
+static void setupDiv (Operands& ops, int len) {
+  randomDigits(ops.a, 2*len);
+  randomDigits(ops.b, len);
+}
+
+// A base of len/16 digits (at least 1), raised to the 16th power,
+// so the result has about len digits
+static void setupPow (Operands& ops, int len) {
+  randomDigits(ops.a, max(1, len/16));
+  ops.b.set(16);
+}
+
+// An odd modulus of len digits, and a base and exponent below it
+static void setupPowmod (Operands& ops, int len) {
+  randomDigits(ops.n, len);
+  if (ops.n.isEven()) ops.n += PosInt(1);
+  randomDigits(ops.a, len);
+  ops.a %= ops.n;
+  randomDigits(ops.b, len);
+}
+
+// A number of len digits, and its decimal form for reading
+static void setupText (Operands& ops, int len) {
+  randomDigits(ops.a, len);
+  ostringstream out;
+  ops.a.print(out);
+  ops.text = out.str();
+}
+
+static void runMul (const Operands& ops) {
+  PosInt c;
+  PosInt::mul(c, ops.a, ops.b);
+}
+
+static void runFastMul (const Operands& ops) {
+  PosInt c(ops.a);
+  c.fastMul(ops.b);
+}
+
+static void runDivrem (const Operands& ops) {
+  PosInt q, r;
+  PosInt::divrem(q, r, ops.a, ops.b);
+}
+
+static void runGcd (const Operands& ops) {
+  PosInt g;
+  g.gcd(ops.a, ops.b);
+}
+
+static void runPow (const Operands& ops) {
+  PosInt c(ops.a);
+  c.pow(ops.b);
+}
+
+static void runPowmod (const Operands& ops) {
+  PosInt r;
+  PosInt::powmod(r, ops.a, ops.b, ops.n);
+}
+
+// Where results that would otherwise be optimized away are stored
+static volatile PosInt::Digit sink;
+
+// powmod on FixedMontContext, at the sizes instantiated below
+template <int Bits>
+static void fixedPowmod (const Operands& ops) {
+  FixedMontContext<Bits> ctx ((FixedPosInt<Bits>(ops.n)));
+  FixedPosInt<Bits> x(ops.a), r;
+  ctx.toMont(x);
+  ctx.powmod(r, x, FixedPosInt<Bits>(ops.b));
+  ctx.fromMont(r);
+  sink = r[0];
+}
+
+static void runFixedPowmod (const Operands& ops) {
+  switch (ops.len) {
+    case 1: fixedPowmod<64>(ops); break;
+    case 4: fixedPowmod<256>(ops); break;
+    case 16: fixedPowmod<1024>(ops); break;
+    case 64: fixedPowmod<4096>(ops); break;
+  }
+}
+
+static void runPrint (const Operands& ops) {
+  ostringstream out;
+  ops.a.print(out);
+}
+
+static void runRead (const Operands& ops) {
+  PosInt x;
+  x.read(ops.text.c_str());
+}
+
+static const Benchmark benchmarks[] = {
+  { "mul", 16384, setupTwo, runMul },
+  { "fastMul", 16384, setupTwo, runFastMul },
+  { "divrem", 16384, setupDiv, runDivrem },
+  { "gcd", 16384, setupTwo, runGcd },
+  { "pow", 16384, setupPow, runPow },
+  { "powmod", 64, setupPowmod, runPowmod },
+  { "fixedPowmod", 64, setupPowmod, runFixedPowmod },
+  { "print", 16384, setupText, runPrint },
+  { "read", 16384, setupText, runRead },
+};
+
+// The timings for one operation and size, in ns per operation
+struct Result {
+  const char* name;
+  int len;
+  int reps;
+  double min, p10, median, p90;
+};
+
+// Returns the nanoseconds taken by reps runs of b on ops
+static double timeRuns (const Benchmark& b, const Operands& ops, int reps) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int i=0; i<reps; ++i) b.run(ops);
+  chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+  return chrono::duration<double, nano>(stop - start).count();
+}
+
+// Warms up b on ops, then times it
+static Result measure (const Benchmark& b, const Operands& ops, int len) {
+  // Warm up, and find how many runs make up a sample
+  double spent = 0;
+  double each = 0;
+  for (int runs = 0; spent < warmupTime || runs < 2; ++runs) {
+    each = timeRuns(b, ops, 1);
+    spent += each;
+  }
+  int reps = max(1, (int)min(sampleTime / max(each, 1.0), 1e6));
+
+  vector<double> times (samples);
+  for (int s=0; s<samples; ++s) times[s] = timeRuns(b, ops, reps) / reps;
+  sort(times.begin(), times.end());
+
+  Result r;
+  r.name = b.name;
+  r.len = len;
+  r.reps = reps;
+  r.min = times[0];
+  r.p10 = times[samples/10];
+  r.median = times[samples/2];
+  r.p90 = times[samples - 1 - samples/10];
+  return r;
+}
+
+static void printJson (const vector<Result>& results) {
+  cout << "{\n  \"samples\": " << samples << ",\n  \"results\": [\n";
+  for (int i=0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    cout << "    { \"op\": \"" << r.name << "\", \"digits\": " << r.len
+         << ", \"reps\": " << r.reps << ", \"min_ns\": " << r.min
+         << ", \"p10_ns\": " << r.p10 << ", \"median_ns\": " << r.median
+         << ", \"p90_ns\": " << r.p90 << " }"
+         << (i+1 < results.size() ? ",\n" : "\n");
+  }
+  cout << "  ]\n}\n";
+}
+
+static void printCsv (const vector<Result>& results) {
+  cout << "op,digits,reps,min_ns,p10_ns,median_ns,p90_ns\n";
+  for (int i=0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    cout << r.name << "," << r.len << "," << r.reps << "," << r.min << ","
+         << r.p10 << "," << r.median << "," << r.p90 << "\n";
+  }
+}
+
+int main (int argc, char** argv) {
+  bool csv = argc > 1 && strcmp(argv[1], "csv") == 0;
+  srand(1);
+  PosInt::setBase(10);
+  cout << fixed;
+  cout.precision(1);
+
+  vector<Result> results;
+  for (const Benchmark& b : benchmarks) {
+    for (int len = 1; len <= b.maxLen; len *= 4) {
+      Operands ops;
+      ops.len = len;
+      b.setup(ops, len);
+      results.push_back(measure(b, ops, len));
+      cerr << b.name << " " << len << ": " << results.back().median << " ns" << endl;
+    }
+  }
+
+  if (csv) printCsv(results);
+  else printJson(results);
+  return 0;
+}
@@ -1,70 +1,193 @@
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
 #include "posint.h"
+#include "fixedposint.h"
 using namespace std;
 
+// Checks FixedPosInt's multiply and FixedMontContext's powmod against
+// PosInt, on random operands of Bits bits
+template <int Bits>
+static bool checkFixed (int trials) {
+  PosInt bound(1);
+  bound <<= Bits;
+  for (int t=0; t<trials; ++t) {
+    PosInt a, b, n, e;
+    a.rand(bound);
+    b.rand(bound);
+    n.rand(bound);
+    e.rand(bound);
+    if (n.isEven()) n += PosInt(1);
+
+    FixedPosInt<2*Bits> prod;
+    FixedPosInt<Bits>::mul(prod, FixedPosInt<Bits>(a), FixedPosInt<Bits>(b));
+    PosInt got;
+    prod.get(got);
+    if (got.compare(a * b) != 0) return false;
+
+    a %= n;
+    FixedMontContext<Bits> ctx ((FixedPosInt<Bits>(n)));
+    FixedPosInt<Bits> x(a), r;
+    ctx.toMont(x);
+    ctx.powmod(r, x, FixedPosInt<Bits>(e));
+    ctx.fromMont(r);
+    PosInt want;
+    PosInt::powmod(want, a, e, n);
+    r.get(got);
+    if (got.compare(want) != 0) return false;
+  }
+  return true;
+}
+
+// Round-trips zero, a single digit and a few longer numbers through
+// importWords and exportWords in every word size, order and byte order
+// here, and through save, load and MappedPosInt. A truncated file
+// must be refused.
+static bool checkBinaryIO () {
+  const char* filename = "driver.tmp";
+  PosInt digitBound(1), bound(1);
+  digitBound <<= 64;
+  bound <<= 1000;
+  PosInt values[4];
+  values[1].set(0x5a);
+  values[2].rand(digitBound);
+  values[3].rand(bound);
+
+  PosInt none;
+  none.importWords(NULL, 0, 8);
+  if (!none.isZero() || values[0].exportWords(NULL, 8) != 0) return false;
+
+  const int sizes[] = { 1, 3, 5, 7, 8, 16 };
+  const PosInt::WordOrder orders[] = { PosInt::LEAST_FIRST, PosInt::MOST_FIRST };
+  const PosInt::ByteOrder endians[] = 
+    { PosInt::LITTLE_END, PosInt::BIG_END, PosInt::NATIVE_END };
+  for (const PosInt& x : values) {
+    for (int size : sizes)
+      for (PosInt::WordOrder order : orders)
+        for (PosInt::ByteOrder endian : endians) {
+          vector<unsigned char> buf (x.exportSize(size) * size + 1);
+          size_t count = x.exportWords(buf.data(), size, order, endian);
+          if (count != x.exportSize(size)) return false;
+          PosInt y;
+          y.importWords(buf.data(), count, size, order, endian);
+          if (y.compare(x) != 0) return false;
+        }
+
+    PosInt y;
+    x.save(filename);
+    y.load(filename);
+    if (y.compare(x) != 0) return false;
+    MappedPosInt mapped (filename);
+    if (mapped.value().compare(x) != 0) return false;
+  }
+
+  // Drop the last digit of the file
+  vector<char> bytes;
+  {
+    ifstream in (filename, ios::binary);
+    bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  }
+  ofstream(filename, ios::binary).write(bytes.data(), bytes.size() - 8);
+  int refused = 0;
+  try {
+    PosInt y;
+    y.load(filename);
+  }
+  catch (MPError&) { ++refused; }
+  try {
+    MappedPosInt mapped (filename);
+  }
+  catch (MPError&) { ++refused; }
+  remove(filename);
+  return refused == 2;
+}
+
 int main() {
+  srand(1);
+  int failures = 0;
 
-  // Set base to 16^3
+  // Set the I/O base to 16.
   // This causes numbers to display in hex.  
-  // However, base must be no greater than 2^15 when
-  // using 32-bit integers, so we can only fit 3 hex 
-  // digits (or 12 bits) per 32-bit int.  It is more
-  // space-efficient to use the default, but then the
-  // numbers will print in binary.
+  // The base only affects print and read; arithmetic is
+  // always done on full 64-bit digits, so it can be
+  // changed at any time without any cost.
   
-  PosInt::setBase(16,3);
+  PosInt::setBase(16);
   
-  PosInt::setBase(10,2);
+  PosInt::setBase(10);
 
   PosInt a(4);
   PosInt b(6);
   cout << "Multiplying " << a << " and " << b << endl;
   a.fastMul(b);
+  cout << "Product: " << a << endl;
 
   PosInt c(22);
   PosInt d(45);
   cout << "Multiplying " << c << " and " << d << endl;
   c.fastMul(d);
+  cout << "Product: " << c << endl;
  
   PosInt e(236);
   PosInt f(147);
   cout << "Multiplying " << e << " and " << f << endl;
   e.fastMul(f);
+  cout << "Product: " << e << endl;
 
   PosInt g(8365);
   PosInt h(2952);
   cout << "Multiplying " << g << " and " << h << endl;
   g.fastMul(h);
+  cout << "Product: " << g << endl;
 
   PosInt i(23452);
   PosInt j(98324);
   cout << "Multiplying " << i << " and " << j << endl;
   i.fastMul(j);
+  cout << "Product: " << i << endl;
 
   PosInt k(346953);
   PosInt l(983467);
   cout << "Multiplying " << k << " and " << l << endl;
   k.fastMul(l);
+  cout << "Product: " << k << endl;
 
   PosInt m(1802313);
   PosInt n(7532679);
   cout << "Multiplying " << m << " and " << n << endl;
   m.fastMul(n);
+  cout << "Product: " << m << endl;
 
   PosInt o(49275630);
   PosInt p(93720571);
   cout << "Multiplying " << o << " and " << p << endl;
   o.fastMul(p);
+  cout << "Product: " << o << endl;
 
   PosInt q(235168734);
   PosInt r(203985673);
   cout << "Multiplying " << q << " and " << 2 << endl;
   q.fastMul(r);
+  cout << "Product: " << q << endl;
 
-  PosInt s(7205629265);
-  PosInt t(4238741005);
+  PosInt s("7205629265");
+  PosInt t("4238741005");
   cout << "Multiplying " << s << " and " << t << endl;
   s.fastMul(t);
+  cout << "Product: " << s << endl;
+
+  // Fixed-width arithmetic, checked against PosInt
+  bool fixedOk = checkFixed<64>(50) && checkFixed<256>(50)
+    && checkFixed<512>(20) && checkFixed<1024>(5);
+  cout << "FixedPosInt mul and powmod: " << (fixedOk ? "OK" : "FAILED") << endl;
+  if (!fixedOk) ++failures;
+
+  // Binary I/O
+  bool binaryOk = checkBinaryIO();
+  cout << "Binary I/O round trips: " << (binaryOk ? "OK" : "FAILED") << endl;
+  if (!binaryOk) ++failures;
 
 
 /*
@@ -99,5 +222,5 @@ int main() {
 
   cout << "z^2 mod x = " << z << endl;
 */
+  return failures == 0 ? 0 : 1;
 }
-  
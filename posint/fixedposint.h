@@ -0,0 +1,242 @@
+#ifndef FIXEDPOSINT_H
+#define FIXEDPOSINT_H
+
+#include <array>
+#include "posint.h"
+
+/* A non-negative integer of exactly Bits bits (a multiple of 64),
+ * kept in an array of digits inside the object, least significant
+ * first. This is meant for the crypto-sized values (256 to 4096 bits)
+ * where PosInt's lengths, heap buffer and normalizing are overhead.
+ * With the number of digits a constant, the compiler can unroll and
+ * schedule the loops below. They are unrolled by 8, which unrolls the
+ * digit loops completely at 256 and 512 bits; unrolling everything
+ * completely measured no different there, and made mulmod 2.4 times
+ * slower at 1024 bits (1100 ns against 460 ns). Arithmetic wraps
+ * around, with the carry or borrow out returned, and products go
+ * into a number twice as wide.
+ */
+template <int Bits>
+class FixedPosInt {
+  static_assert(Bits > 0 && Bits % 64 == 0,
+    "FixedPosInt needs a positive multiple of 64 bits");
+
+  public:
+    typedef PosInt::Digit Digit;
+    typedef PosInt::DDigit DDigit;
+
+    // The number of digits
+    static constexpr int N = Bits / 64;
+
+    // Initializes to zero, or to a single digit
+    constexpr FixedPosInt () :d() { }
+    constexpr explicit FixedPosInt (Digit x) :d() { d[0] = x; }
+
+    // Conversions from and to PosInt. Throws MPError if x doesn't fit.
+    explicit FixedPosInt (const PosInt& x) :d() { set(x); }
+    void set (const PosInt& x) {
+      int len = x.digits.size();
+      if (len > N)
+        throw MPError("Value is too large for FixedPosInt");
+      for (int i=0; i<N; ++i) d[i] = i < len ? x.digits[i] : 0;
+    }
+    void get (PosInt& x) const {
+      x.digits.assign(d.begin(), d.end());
+      x.normalize();
+    }
+
+    // Digit access
+    constexpr Digit& operator[] (int i) { return d[i]; }
+    constexpr const Digit& operator[] (int i) const { return d[i]; }
+
+    constexpr bool isZero () const {
+      Digit any = 0;
+      for (int i=0; i<N; ++i) any |= d[i];
+      return any == 0;
+    }
+    constexpr bool testBit (int i) const { return (d[i/64] >> (i%64)) & 1; }
+    constexpr int bitLength () const {
+      for (int i=N-1; i>=0; --i)
+        if (d[i]) return 64*i + 64 - __builtin_clzll(d[i]);
+      return 0;
+    }
+
+    // Result is -1, 0, or 1 if this is <, =, or > than x.
+    constexpr int compare (const FixedPosInt& x) const {
+      for (int i=N-1; i>=0; --i)
+        if (d[i] != x.d[i]) return d[i] < x.d[i] ? -1 : 1;
+      return 0;
+    }
+
+    // dest = a + b mod 2^Bits; returns the carry out
+    static constexpr Digit add
+      (FixedPosInt& dest, const FixedPosInt& a, const FixedPosInt& b)
+    {
+      Digit carry = 0;
+#pragma GCC unroll 8
+      for (int i=0; i<N; ++i) {
+        DDigit sum = (DDigit)a.d[i] + b.d[i] + carry;
+        dest.d[i] = (Digit)sum;
+        carry = (Digit)(sum >> 64);
+      }
+      return carry;
+    }
+
+    // dest = a - b mod 2^Bits; returns the borrow out
+    static constexpr Digit sub
+      (FixedPosInt& dest, const FixedPosInt& a, const FixedPosInt& b)
+    {
+      Digit borrow = 0;
+#pragma GCC unroll 8
+      for (int i=0; i<N; ++i) {
+        DDigit diff = (DDigit)a.d[i] - b.d[i] - borrow;
+        dest.d[i] = (Digit)diff;
+        borrow = (Digit)(diff >> 64) & 1;
+      }
+      return borrow;
+    }
+
+    // dest = a * b, in full. dest must be distinct from a and b,
+    // which it is by its type. Scans the product a column at a time,
+    // as PosInt's schoolbook multiply does.
+    static constexpr void mul
+      (FixedPosInt<2*Bits>& dest, const FixedPosInt& a, const FixedPosInt& b)
+    {
+      DDigit acc = 0;
+      Digit top = 0;
+#pragma GCC unroll 8
+      for (int k=0; k<2*N-1; ++k) {
+#pragma GCC unroll 8
+        for (int i = (k < N ? 0 : k-N+1); i <= k && i < N; ++i) {
+          DDigit prod = (DDigit)a.d[i] * b.d[k-i];
+          acc += prod;
+          top += (acc < prod);
+        }
+        dest[k] = (Digit)acc;
+        acc = (acc >> 64) | ((DDigit)top << 64);
+        top = 0;
+      }
+      dest[2*N-1] = (Digit)acc;
+    }
+
+  private:
+    std::array<Digit, N> d;
+};
+
+/* Montgomery arithmetic modulo an odd n of at most Bits bits, like
+ * MontContext but on FixedPosInt. The multiply interleaves the
+ * product with the reduction a digit at a time (CIOS), so it needs
+ * only N+2 digits of working space and no heap at all. Values are
+ * less than n, and the methods only read the context, so it can be
+ * shared between threads.
+ */
+template <int Bits>
+class FixedMontContext {
+  public:
+    typedef FixedPosInt<Bits> Value;
+    typedef PosInt::Digit Digit;
+    typedef PosInt::DDigit DDigit;
+    static constexpr int N = Value::N;
+
+    // Throws MPError if the modulus is even
+    explicit FixedMontContext (const Value& modulus) :n(modulus) {
+      if (!n.testBit(0))
+        throw MPError("Montgomery modulus must be odd");
+      Digit inv = n[0];
+      for (int i=0; i<5; ++i) inv *= 2 - n[0]*inv;
+      ninv = -inv;
+
+      // R = B^N mod n and R^2 mod n, found once with PosInt
+      PosInt big, mod;
+      n.get(mod);
+      big.set(1);
+      big <<= 64*N;
+      big %= mod;
+      r1.set(big);
+      big *= big;
+      big %= mod;
+      r2.set(big);
+    }
+
+    const Value& modulus () const { return n; }
+
+    // The Montgomery form of 1
+    const Value& one () const { return r1; }
+
+    // x = x * B^N mod n, which puts x (less than n) into Montgomery
+    // form, and x = x / B^N mod n, which takes it back out
+    void toMont (Value& x) const { mulmod(x, x, r2); }
+    void fromMont (Value& x) const { mulmod(x, x, Value(1)); }
+
+    // result = a * b / B^N mod n. result may be a or b.
+    void mulmod (Value& result, const Value& a, const Value& b) const {
+      Digit t[N+2] = { };
+#pragma GCC unroll 8
+      for (int i=0; i<N; ++i) {
+        DDigit c = 0;
+#pragma GCC unroll 8
+        for (int j=0; j<N; ++j) {
+          c += (DDigit)a[j] * b[i] + t[j];
+          t[j] = (Digit)c;
+          c >>= 64;
+        }
+        c += t[N];
+        t[N] = (Digit)c;
+        t[N+1] = (Digit)(c >> 64);
+
+        // Add m*n, which clears the bottom digit, and shift it off
+        Digit m = t[0] * ninv;
+        c = ((DDigit)m * n[0] + t[0]) >> 64;
+#pragma GCC unroll 8
+        for (int j=1; j<N; ++j) {
+          c += (DDigit)m * n[j] + t[j];
+          t[j-1] = (Digit)c;
+          c >>= 64;
+        }
+        c += t[N];
+        t[N-1] = (Digit)c;
+        t[N] = t[N+1] + (Digit)(c >> 64);
+      }
+
+      // t < 2n, so one subtraction finishes the reduction
+      for (int i=0; i<N; ++i) result[i] = t[i];
+      if (t[N] || result.compare(n) >= 0) Value::sub(result, result, n);
+    }
+
+    // result = a * a / B^N mod n
+    void sqrmod (Value& result, const Value& a) const { mulmod(result, a, a); }
+
+    // result = a^e, with a and the result in Montgomery form, by fixed
+    // windows of 4 bits over a table of a^0 .. a^15
+    template <int EBits>
+    void powmod (Value& result, const Value& a, const FixedPosInt<EBits>& e) const {
+      Value table[16];
+      table[0] = r1;
+      table[1] = a;
+      for (int j=2; j<16; ++j) mulmod(table[j], table[j-1], a);
+
+      int i = (e.bitLength() + 3) / 4 - 1;
+      if (i < 0) {
+        result = r1;
+        return;
+      }
+      Value acc = table[window(e, i)];
+      for (--i; i >= 0; --i) {
+        for (int s=0; s<4; ++s) sqrmod(acc, acc);
+        mulmod(acc, acc, table[window(e, i)]);
+      }
+      result = acc;
+    }
+
+  private:
+    Value n;
+    Digit ninv;
+    Value r1, r2;
+
+    // Returns bits 4i to 4i+3 of e
+    template <int EBits>
+    static int window (const FixedPosInt<EBits>& e, int i)
+      { return (e[i/16] >> (4*(i%16))) & 15; }
+};
+
+#endif // FIXEDPOSINT_H
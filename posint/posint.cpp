@@ -4,23 +4,36 @@
 #include <sstream>
 #include <math.h>
 #include <ctime>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "posint.h"
+#include "tuning.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "stats.h"
 
 using namespace std;
 
 /******************** BASE ********************/
 
-int PosInt::B = 0x8000;
 int PosInt::Bbase = 2;
-int PosInt::Bpow = 15;
+int PosInt::Bpow = 63;
+PosInt::Digit PosInt::Bchunk = (PosInt::Digit)1 << 63;
 
-void PosInt::setBase(int base, int pow) {
+void PosInt::setBase(int base, int /*pow*/) {
+  if (base < 2 || base > 36)
+    throw MPError("Base must be between 2 and 36");
   Bbase = base;
-  Bpow = pow;
-  B = base;
-  while (pow > 1) {
-    B *= Bbase;
-    --pow;
+  Bpow = 1;
+  Bchunk = base;
+  while (Bchunk <= (~(Digit)0) / base) {
+    Bchunk *= base;
+    ++Bpow;
   }
 }
 
@@ -38,10 +51,7 @@ void PosInt::set(int x) {
   if (x < 0)
     throw MPError("Can't set PosInt to negative value");
 
-  while (x > 0) {
-    digits.push_back(x % B);
-    x /= B;
-  }
+  if (x > 0) digits.push_back(x);
 }
 
 void PosInt::set (const PosInt& rhs) {
@@ -56,72 +66,176 @@ void PosInt::print_array(ostream& out) const {
   out << " ms]";
 }
 
+// Numbers of at least this many digits are converted to and from
+// Bbase by divide and conquer over a tower of powers of Bchunk
+static const int radixThreshold = 30;
+
+// The cached tower of Bchunk^(2^k), for the base in towerBase. The
+// lock makes printing and reading from several threads safe.
+static vector<PosInt> towerCache;
+static int towerBase = 0;
+static mutex towerLock;
+
+// Sets tower to Bchunk^(2^k) for k < levels, squaring up from the cache
+void PosInt::powerTower (vector<PosInt>& tower, int levels) {
+  lock_guard<mutex> hold (towerLock);
+  if (towerBase != Bbase) {
+    towerCache.clear();
+    towerBase = Bbase;
+  }
+  if (towerCache.empty()) {
+    towerCache.push_back(PosInt());
+    towerCache.back().digits.push_back(Bchunk);
+  }
+  while (towerCache.size() < levels) {
+    PosInt next (towerCache.back());
+    next.sqr();
+    towerCache.push_back(next);
+  }
+  tower.assign(towerCache.begin(), towerCache.begin() + levels);
+}
+
+// Writes chunk in the given base, padded with 0s to at least width
+// characters.
+static void printChunk (string& out, PosInt::Digit chunk, int base, int width) {
+  char buf[72];
+  int n = 0;
+  do {
+    int subdigit = chunk % base;
+    buf[n++] = subdigit < 10 ? '0' + subdigit : 'A' + (subdigit - 10);
+    chunk /= base;
+  } while (chunk > 0);
+  for (; n < width; ++n) buf[n] = '0';
+  while (n > 0) out += buf[--n];
+}
+
+void PosInt::printSmall (string& out, int width) const {
+  // Peel off Bpow base-Bbase digits at a time, least-significant
+  // chunk first, by repeated division by Bchunk.
+  vector<Digit> temp (digits.begin(), digits.end());
+  vector<Digit> chunks;
+  int len = temp.size();
+  while (len > 0) {
+    chunks.push_back (divDigit (&temp[0], Bchunk, len));
+    while (len > 0 && temp[len-1] == 0) --len;
+  }
+  if (chunks.empty()) chunks.push_back(0);
+
+  string s;
+  int i = chunks.size()-1;
+  printChunk (s, chunks[i], Bbase, 0);
+  while (--i >= 0) printChunk (s, chunks[i], Bbase, Bpow);
+  if (s.size() < width) out.append(width - s.size(), '0');
+  out += s;
+}
+
+void PosInt::printTower (string& out, const PosInt& x, 
+  const vector<PosInt>& tower, int k, bool pad)
+{
+  if (k < 0 || x.digits.size() < radixThreshold) {
+    x.printSmall(out, pad ? Bpow << (k+1) : 0);
+    return;
+  }
+  PosInt q, r;
+  divrem(q, r, x, tower[k]);
+  if (pad || !q.isZero()) {
+    printTower(out, q, tower, k-1, pad);
+    printTower(out, r, tower, k-1, true);
+  }
+  else printTower(out, r, tower, k-1, false);
+}
+
 void PosInt::print(ostream& out) const {
-  if (digits.empty()) out << 0;
+  STATS_OP(STATS_PRINT);
+  if (digits.empty()) {
+    out << 0;
+    return;
+  }
+  string s;
+  if (digits.size() < radixThreshold) printSmall(s, 0);
   else {
-    int i = digits.size()-1;
-    int pow = B/Bbase;
-    int digit = digits[i];
-    for (; digit < pow; pow /= Bbase);
-    while (true) {
-      for (; pow>0; pow /= Bbase) {
-        int subdigit = digit / pow;
-        if (subdigit < 10) out << subdigit;
-        else out << (char)('A' + (subdigit - 10));
-        digit -= subdigit*pow;
-      }
-      if (--i < 0) break;
-      digit = digits[i];
-      pow = B/Bbase;
+    // Bchunk^(2^levels) is at least 2^(chunkBits * 2^levels), 
+    // which is more than this
+    int chunkBits = 63 - __builtin_clzll(Bchunk);
+    int levels = 1;
+    while ((long long)chunkBits << levels < bitLength()) ++levels;
+    vector<PosInt> tower;
+    powerTower(tower, levels);
+    printTower(s, *this, tower, levels-1, false);
+  }
+  out << s;
+}
+
+// this = this * pow + chunk
+void PosInt::mulAddChunk (Digit pow, Digit chunk) {
+  digits.push_back(0);
+  mulDigit (&digits[0], pow, digits.size());
+  addArray (&digits[0], &chunk, 1);
+}
+
+void PosInt::readSmall (const char* s, int n) {
+  digits.clear();
+  Digit pow = 1;
+  Digit chunk = 0;
+  for (int i=0; i<n; ++i) {
+    chunk = chunk*Bbase + s[i];
+    pow *= Bbase;
+    if (pow == Bchunk) {
+      mulAddChunk (pow, chunk);
+      pow = 1;
+      chunk = 0;
     }
   }
+  if (pow > 1) mulAddChunk (pow, chunk);
+  normalize();
+}
+
+void PosInt::readTower (const char* s, int n, const vector<PosInt>& tower) {
+  if (n < radixThreshold * Bpow) {
+    readSmall(s, n);
+    return;
+  }
+  // The low part has Bpow * 2^k subdigits, fewer than n
+  int k = tower.size()-1;
+  while (k > 0 && Bpow << k >= n) --k;
+  int low = Bpow << k;
+  PosInt lowpart;
+  lowpart.readTower(s + n - low, low, tower);
+  readTower(s, n - low, tower);
+  mul(tower[k]);
+  add(lowpart);
 }
 
 void PosInt::read (istream& in) {
-  vector<int> digstack;
+  STATS_OP(STATS_READ);
   while (isspace(in.peek())) in.get();
-  int pow = B/Bbase;
-  int digit = 0;
-  int subdigit;
+  // Gather the subdigit values, then convert them all at once
+  string sub;
   while (true) {
     int next = in.peek();
+    int subdigit;
     if (isdigit(next)) subdigit = next-'0';
     else if (islower(next)) subdigit = next - 'a' + 10;
     else if (isupper(next)) subdigit = next - 'A' + 10;
     else subdigit = Bbase;
     if (subdigit >= Bbase) break;
-    digit += pow*subdigit;
+    sub += char(subdigit);
     in.get();
-    if (pow == 1) {
-      digstack.push_back (digit);
-      pow = B/Bbase;
-      digit = 0;
-    }
-    else pow /= Bbase;
   }
-  pow *= Bbase;
-  if (pow == B && !digstack.empty()) {
-    pow = 1;
-    digit = digstack.back();
-    digstack.pop_back();
-  }
-  int pmul = B/pow;
-  digits.assign (1, digit/pow);
-  for (int i=digstack.size()-1; i >= 0; --i) {
-    digits.back() += (digstack[i] % pow) * pmul;
-    digits.push_back (digstack[i] / pow);
+
+  int n = sub.size();
+  if (n < radixThreshold * Bpow) readSmall(sub.data(), n);
+  else {
+    int levels = 1;
+    while (Bpow << levels < n) ++levels;
+    vector<PosInt> tower;
+    powerTower(tower, levels);
+    readTower(sub.data(), n, tower);
   }
-  normalize();
 }
 
 int PosInt::convert () const {
-  int val = 0;
-  int pow = 1;
-  for (int i = 0; i < digits.size(); ++i) {
-    val += pow * digits[i];
-    pow *= B;
-  }
-  return val;
+  return digits.empty() ? 0 : (int)digits[0];
 }
 
 ostream& operator<< (ostream& out, const PosInt& x) { 
@@ -134,15 +248,221 @@ istream& operator>> (istream& in, PosInt& x) {
   return in;
 }
 
+/******************** BINARY I/O ********************/
+
+static const bool littleHost = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+// Sets this to the count words of size bytes each at data
+void PosInt::importWords (const void* data, size_t count, int size, 
+  WordOrder order, ByteOrder endian)
+{
+  if (size < 1) throw MPError("Word size must be positive");
+  if (count == 0) {
+    set(0);
+    return;
+  }
+  if (endian == NATIVE_END) endian = littleHost ? LITTLE_END : BIG_END;
+  const unsigned char* p = (const unsigned char*)data;
+
+  if (size == 8) {
+    digits.resize(count);
+    if (order == LEAST_FIRST && (endian == LITTLE_END) == littleHost)
+      memcpy(digits.data(), p, 8*count);
+    else {
+      bool swap = (endian == LITTLE_END) != littleHost;
+      for (size_t i=0; i<count; ++i) {
+        Digit d;
+        memcpy(&d, p + 8*(order == LEAST_FIRST ? i : count-1-i), 8);
+        digits[i] = swap ? __builtin_bswap64(d) : d;
+      }
+    }
+  }
+  else {
+    // Byte b of the number, counting from the least significant,
+    // is byte b % size of word b / size
+    digits.assign((count*size + 7) / 8, 0);
+    for (size_t w=0; w<count; ++w) {
+      const unsigned char* word = p + (order == LEAST_FIRST ? w : count-1-w)*size;
+      for (int j=0; j<size; ++j) {
+        size_t b = w*size + j;
+        Digit byte = word[endian == LITTLE_END ? j : size-1-j];
+        digits[b/8] |= byte << (8*(b%8));
+      }
+    }
+  }
+  normalize();
+}
+
+// Returns the number of words of size bytes that exportWords writes
+size_t PosInt::exportSize (int size) const {
+  if (size < 1) throw MPError("Word size must be positive");
+  return ((size_t)bitLength() + 8*size - 1) / (8*size);
+}
+
+// Writes this to data as exportSize(size) words of size bytes each
+size_t PosInt::exportWords (void* data, int size, 
+  WordOrder order, ByteOrder endian) const
+{
+  size_t count = exportSize(size);
+  if (count == 0) return 0;
+  if (endian == NATIVE_END) endian = littleHost ? LITTLE_END : BIG_END;
+  unsigned char* p = (unsigned char*)data;
+
+  if (size == 8) {
+    if (order == LEAST_FIRST && (endian == LITTLE_END) == littleHost)
+      memcpy(p, digits.data(), 8*count);
+    else {
+      bool swap = (endian == LITTLE_END) != littleHost;
+      for (size_t i=0; i<count; ++i) {
+        Digit d = swap ? __builtin_bswap64(digits[i]) : digits[i];
+        memcpy(p + 8*(order == LEAST_FIRST ? i : count-1-i), &d, 8);
+      }
+    }
+  }
+  else {
+    for (size_t w=0; w<count; ++w) {
+      unsigned char* word = p + (order == LEAST_FIRST ? w : count-1-w)*size;
+      for (int j=0; j<size; ++j) {
+        size_t b = w*size + j;
+        Digit byte = b/8 < digits.size() ? digits[b/8] >> (8*(b%8)) : 0;
+        word[endian == LITTLE_END ? j : size-1-j] = (unsigned char)byte;
+      }
+    }
+  }
+  return count;
+}
+
+// The binary file format, version 1. All fields are little-endian.
+//   bytes 0-7    fileMagic
+//   bytes 8-11   version (1)
+//   bytes 12-15  header size in bytes (32), where the digits start
+//   bytes 16-23  number of digits
+//   bytes 24-31  reserved (0)
+// The digits follow as 64-bit words, least significant first, so on a
+// little-endian machine they can be used straight from a mapping.
+static const char fileMagic[8] = { 'P', 'O', 'S', 'I', 'N', 'T', '\x1a', '\n' };
+static const uint32_t fileVersion = 1;
+static const int fileHeaderSize = 32;
+
+// Stores the low bytes of v at p, little-endian
+static void putLittle (unsigned char* p, uint64_t v, int bytes) {
+  for (int i=0; i<bytes; ++i) p[i] = (unsigned char)(v >> (8*i));
+}
+
+static uint64_t getLittle (const unsigned char* p, int bytes) {
+  uint64_t v = 0;
+  for (int i=0; i<bytes; ++i) v |= (uint64_t)p[i] << (8*i);
+  return v;
+}
+
+// Checks the header of a file of fileSize bytes in the binary format,
+// and returns the number of digits that follow it
+static uint64_t readFileHeader (const unsigned char* header, uint64_t fileSize) {
+  if (fileSize < fileHeaderSize || memcmp(header, fileMagic, 8) != 0)
+    throw MPError("Not a PosInt file");
+  else if (getLittle(header + 8, 4) != fileVersion
+           || getLittle(header + 12, 4) != fileHeaderSize)
+    throw MPError("Unsupported PosInt file version");
+  uint64_t count = getLittle(header + 16, 8);
+  uint64_t body = fileSize - fileHeaderSize;
+  if (body % 8 != 0 || body / 8 != count)
+    throw MPError("PosInt file has the wrong length");
+  return count;
+}
+
+void PosInt::save (const char* filename) const {
+  ofstream out (filename, ios::binary);
+  if (!out) throw MPError("Can't open file for writing");
+
+  unsigned char header[fileHeaderSize] = { };
+  memcpy(header, fileMagic, 8);
+  putLittle(header + 8, fileVersion, 4);
+  putLittle(header + 12, fileHeaderSize, 4);
+  putLittle(header + 16, digits.size(), 8);
+  out.write((const char*)header, fileHeaderSize);
+
+  if (littleHost) out.write((const char*)digits.data(), 8*digits.size());
+  else {
+    vector<Digit> words (digits.size());
+    exportWords(words.data(), 8, LEAST_FIRST, LITTLE_END);
+    out.write((const char*)words.data(), 8*words.size());
+  }
+  out.close();
+  if (!out) throw MPError("Error writing file");
+}
+
+void PosInt::load (const char* filename) {
+  ifstream in (filename, ios::binary);
+  if (!in) throw MPError("Can't open file for reading");
+  in.seekg(0, ios::end);
+  uint64_t fileSize = in.tellg();
+  in.seekg(0, ios::beg);
+
+  unsigned char header[fileHeaderSize] = { };
+  in.read((char*)header, fileHeaderSize);
+  uint64_t count = readFileHeader(header, fileSize);
+  digits.resize(count);
+  in.read((char*)digits.data(), 8*count);
+  if (!in) throw MPError("Error reading file");
+  if (!littleHost)
+    for (size_t i=0; i<count; ++i) digits[i] = __builtin_bswap64(digits[i]);
+  normalize();
+}
+
+MappedPosInt::MappedPosInt (const char* filename) :base(NULL), length(0) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw MPError("Can't open file for reading");
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < fileHeaderSize) {
+    close(fd);
+    throw MPError("Not a PosInt file");
+  }
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) throw MPError("Can't map file");
+  base = mapped;
+  length = st.st_size;
+
+  const unsigned char* bytes = (const unsigned char*)base;
+  uint64_t count;
+  try {
+    count = readFileHeader(bytes, length);
+  }
+  catch (MPError&) {
+    munmap(base, length);
+    throw;
+  }
+
+  // The digits are used where they are, unless they need byte-swapping.
+  // Normalizing only shortens the vector, so it writes nothing.
+  PosInt::Digit* d = (PosInt::Digit*)(bytes + fileHeaderSize);
+  if (littleHost) x.digits.borrow(d, count);
+  else x.importWords(d, count, 8, PosInt::LEAST_FIRST, PosInt::LITTLE_END);
+  x.normalize();
+}
+
+MappedPosInt::~MappedPosInt () {
+  munmap(base, length);
+}
+
 /******************** RANDOM NUMBERS ********************/
 
-// Produces a random number between 0 and n-1
-static int randomInt (int n) {
-  int max = RAND_MAX - ((RAND_MAX-n+1) % n);
-  int r;
-  do { r = rand(); }
-  while (r > max);
-  return r % n;
+// Produces a uniformly random digit, 15 bits at a time since
+// RAND_MAX is only guaranteed to be at least 2^15 - 1.
+static PosInt::Digit randomDigit () {
+  PosInt::Digit r = 0;
+  for (int i = 0; i < 5; ++i)
+    r = (r << 15) ^ (rand() & 0x7FFF);
+  return r;
+}
+
+// A step of the SplitMix64 generator, for random numbers that must
+// not touch rand()'s shared state
+static PosInt::Digit splitMix (PosInt::Digit& state) {
+  PosInt::Digit z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
 }
 
 // Sets this PosInt to a random number between 0 and x-1
@@ -161,7 +481,7 @@ void PosInt::rand (const PosInt& x) {
     do {
       digits.resize(x.digits.size());
       for (int i=0; i<digits.size(); ++i)
-        digits[i] = randomInt(B);
+        digits[i] = randomDigit();
       normalize();
     } while (compare(max) >= 0);
     mod(x);
@@ -177,17 +497,85 @@ void PosInt::normalize () {
   if (i+1 < digits.size()) digits.resize(i+1);
 }
 
+// this = this * 2^bits
+void PosInt::shiftLeft (int bits) {
+  int len = digits.size();
+  if (len == 0 || bits == 0) return;
+  int dshift = bits / 64;
+  int bshift = bits % 64;
+  digits.resize(len + dshift + 1, 0);
+  if (bshift == 0) {
+    for (int i = len-1; i >= 0; --i) digits[i+dshift] = digits[i];
+    digits[len+dshift] = 0;
+  }
+  else {
+    digits[len+dshift] = digits[len-1] >> (64-bshift);
+    for (int i = len-1; i > 0; --i)
+      digits[i+dshift] = (digits[i] << bshift) | (digits[i-1] >> (64-bshift));
+    digits[dshift] = digits[0] << bshift;
+  }
+  for (int i=0; i<dshift; ++i) digits[i] = 0;
+  normalize();
+}
+
+// this = this / 2^bits, rounded down
+void PosInt::shiftRight (int bits) {
+  int len = digits.size();
+  int dshift = bits / 64;
+  int bshift = bits % 64;
+  if (dshift >= len) {
+    digits.clear();
+    return;
+  }
+  for (int i=0; i < len-dshift; ++i) {
+    Digit cur = digits[i+dshift] >> bshift;
+    if (bshift && i+dshift+1 < len) cur |= digits[i+dshift+1] << (64-bshift);
+    digits[i] = cur;
+  }
+  digits.resize(len-dshift);
+  normalize();
+}
+
+PosInt& PosInt::operator<<= (int bits) {
+  if (bits < 0) throw MPError("Can't shift by a negative amount");
+  shiftLeft(bits);
+  return *this;
+}
+
+PosInt& PosInt::operator>>= (int bits) {
+  if (bits < 0) throw MPError("Can't shift by a negative amount");
+  shiftRight(bits);
+  return *this;
+}
+
 bool PosInt::isEven() const {
-  if (B % 2 == 0) return digits.empty() || (digits[0] % 2 == 0);
-  int sum = 0;
-  for (int i = 0; i < digits.size(); ++i)
-    sum += digits[i] % 2;
-  return sum % 2 == 0;
+  return digits.empty() || (digits[0] % 2 == 0);
+}
+
+// Returns the number of bits, not counting leading zeros
+int PosInt::bitLength() const {
+  if (digits.empty()) return 0;
+  return 64*(digits.size()-1) + (64 - __builtin_clzll(digits.back()));
+}
+
+// Returns bit i, counting from the least-significant bit 0
+bool PosInt::testBit(int i) const {
+  int d = i / 64;
+  return d < digits.size() && ((digits[d] >> (i % 64)) & 1);
+}
+
+// Returns d^(-1) mod B, for odd d, by Newton iteration.
+// Each step doubles the number of correct low bits, and d itself
+// is already its own inverse mod 8.
+static PosInt::Digit inverseDigit (PosInt::Digit d) {
+  PosInt::Digit inv = d;
+  for (int i=0; i<5; ++i) inv *= 2 - d*inv;
+  return inv;
 }
 
 // Result is -1, 0, or 1 if a is <, =, or > than b,
 // up to the specified length.
-int PosInt::compareDigits (const int* a, int alen, const int* b, int blen) {
+int PosInt::compareDigits (const Digit* a, int alen, const Digit* b, int blen) {
   int i = max(alen, blen)-1;
   for (; i >= blen; --i) {
     if (a[i] > 0) return 1;
@@ -211,30 +599,135 @@ int PosInt::compare (const PosInt& x) const {
     (&digits[0], digits.size(), &x.digits[0], x.digits.size());
 }
 
-/******************** ADDITION ********************/
+/******************** STATISTICS ********************/
+
+// The names of the kernels and operations in stats.h, in order
+static const char* kernelNames[STATS_KERNELS] = {
+  "addArray", "subArray", "mulArray", "sqrArray",
+  "fastMulArray", "fastSqrArray", "toom3MulArray",
+  "toom4MulArray", "nttMulArray", "parFastMulArray",
+  "mulDigit", "divDigit", "divremArray",
+  "bzDivremArray", "newtonDivremArray", "montMulArray"
+};
+
+static const char* opNames[STATS_OPS] = {
+  "add", "sub", "mul", "fastMul", "sqr",
+  "divrem", "pow", "powmod", "gcd", "xgcd",
+  "modinv", "print", "read", "MillerRabin",
+  "mulBatch", "powmodBatch", "modinvBatch"
+};
+
+#ifdef POSINT_STATS
+
+// The counters are updated from any thread, and only need to add up
+// correctly, so relaxed atomics will do
+static atomic<uint64_t> kernelCalls[STATS_KERNELS], kernelDigits[STATS_KERNELS];
+static atomic<uint64_t> opCalls[STATS_OPS], opTime[STATS_OPS];
+static atomic<uint64_t> scratchDigits (0);
+static atomic<int> maxDepth (0);
+static thread_local int depth = 0;
+static PosInt::StatsCallback statsCallback = NULL;
+static void* statsData = NULL;
+
+void statsKernel (StatsKernel k, long len) {
+  kernelCalls[k].fetch_add(1, memory_order_relaxed);
+  kernelDigits[k].fetch_add(len, memory_order_relaxed);
+}
 
-// Computes dest += x, digit-wise
-// REQUIREMENT: dest has enough space to hold the complete sum.
-void PosInt::addArray (int* dest, const int* x, int len) {
-  int i;
-  for (i=0; i < len; ++i)
-    dest[i] += x[i];
+void statsScratch (long digits) {
+  scratchDigits.fetch_add(digits, memory_order_relaxed);
+}
 
-  for (i=0; i+1 < len; ++i) {
-    if (dest[i] >= B) {
-      dest[i] -= B;
-      ++dest[i+1];
-    }
+StatsDepth::StatsDepth () {
+  int d = ++depth;
+  int seen = maxDepth.load(memory_order_relaxed);
+  while (d > seen && !maxDepth.compare_exchange_weak(seen, d)) { }
+}
+
+StatsDepth::~StatsDepth () {
+  --depth;
+}
+
+StatsTimer::StatsTimer (StatsOp o) :op(o), start(chrono::steady_clock::now()) { }
+
+StatsTimer::~StatsTimer () {
+  uint64_t ns = chrono::duration_cast<chrono::nanoseconds>
+    (chrono::steady_clock::now() - start).count();
+  opCalls[op].fetch_add(1, memory_order_relaxed);
+  opTime[op].fetch_add(ns, memory_order_relaxed);
+  if (statsCallback) statsCallback(opNames[op], ns, statsData);
+}
+
+#endif // POSINT_STATS
+
+void PosInt::getStats (Stats& s) {
+  s.kernels.assign(STATS_KERNELS, KernelStats());
+  s.ops.assign(STATS_OPS, OpStats());
+  s.maxKaratsubaDepth = 0;
+  s.scratchBytes = 0;
+  for (int k=0; k<STATS_KERNELS; ++k) s.kernels[k].name = kernelNames[k];
+  for (int op=0; op<STATS_OPS; ++op) s.ops[op].name = opNames[op];
+#ifdef POSINT_STATS
+  for (int k=0; k<STATS_KERNELS; ++k) {
+    s.kernels[k].calls = kernelCalls[k].load(memory_order_relaxed);
+    s.kernels[k].digits = kernelDigits[k].load(memory_order_relaxed);
   }
+  for (int op=0; op<STATS_OPS; ++op) {
+    s.ops[op].calls = opCalls[op].load(memory_order_relaxed);
+    s.ops[op].nanoseconds = opTime[op].load(memory_order_relaxed);
+  }
+  s.maxKaratsubaDepth = maxDepth.load(memory_order_relaxed);
+  s.scratchBytes = scratchDigits.load(memory_order_relaxed) * sizeof(Digit);
+#endif
+}
 
-  for ( ; dest[i] >= B; ++i) {
-    dest[i] -= B;
-    ++dest[i+1];
+void PosInt::resetStats () {
+#ifdef POSINT_STATS
+  for (int k=0; k<STATS_KERNELS; ++k) {
+    kernelCalls[k] = 0;
+    kernelDigits[k] = 0;
   }
+  for (int op=0; op<STATS_OPS; ++op) {
+    opCalls[op] = 0;
+    opTime[op] = 0;
+  }
+  scratchDigits = 0;
+  maxDepth = 0;
+#endif
+}
+
+void PosInt::setStatsCallback (StatsCallback fn, void* data) {
+#ifdef POSINT_STATS
+  statsCallback = fn;
+  statsData = data;
+#else
+  (void)fn;
+  (void)data;
+#endif
+}
+
+/******************** ADDITION ********************/
+
+PosInt::SimdLevel PosInt::getSimdLevel () {
+  return simdLevel();
+}
+
+void PosInt::setSimdLevel (SimdLevel level) {
+  setSimdKernels(level);
+}
+
+// Computes dest += x, digit-wise
+// REQUIREMENT: dest has enough space to hold the complete sum.
+void PosInt::addArray (Digit* dest, const Digit* x, int len) {
+  STATS_KERNEL(STATS_ADD_ARRAY, len);
+  Digit carry = simdAdd(dest, x, len);
+  for (int i = len; carry; ++i)
+    carry = (++dest[i] == 0);
 }
 
 // this = this + x
 void PosInt::add (const PosInt& x) {
+  STATS_OP(STATS_ADD);
   digits.resize(max(digits.size(), x.digits.size())+1, 0);
   addArray (&digits[0], &x.digits[0], x.digits.size());
   normalize();
@@ -244,29 +737,16 @@ void PosInt::add (const PosInt& x) {
 
 // Computes dest -= x, digit-wise
 // REQUIREMENT: dest >= x, so the difference is non-negative
-void PosInt::subArray (int* dest, const int* x, int len) {
-
-  int i = 0;
-  for ( ; i < len; ++i)
-    dest[i] -= x[i];
-
-  for (i=0; i+1 < len; ++i) {
-    if (dest[i] < 0) {
-      dest[i] += B;
-      --dest[i+1];
-    }
-  }
-
-  for ( ; dest[i] < 0; ++i) {
-    dest[i] += B;
-    --dest[i+1];
-  }
-
- // cout << "sub- Dest : " << *dest << endl;
+void PosInt::subArray (Digit* dest, const Digit* x, int len) {
+  STATS_KERNEL(STATS_SUB_ARRAY, len);
+  Digit borrow = simdSub(dest, x, len);
+  for (int i = len; borrow; ++i)
+    borrow = (dest[i]-- == 0);
 }
 
 // this = this - x
 void PosInt::sub (const PosInt& x) {
+  STATS_OP(STATS_SUB);
   if (compare(x) < 0)
     throw MPError("Subtraction would result in negative number");
   else if (x.digits.size() > 0) {
@@ -275,332 +755,1217 @@ void PosInt::sub (const PosInt& x) {
   }
 }
 
+// dest = a + b, adding the shorter operand into a copy of the longer
+void PosInt::add (PosInt& dest, const PosInt& a, const PosInt& b) {
+  if (&dest == &a) dest.add(b);
+  else if (&dest == &b) dest.add(a);
+  else {
+    STATS_OP(STATS_ADD);
+    const PosInt& longer = a.digits.size() >= b.digits.size() ? a : b;
+    const PosInt& shorter = a.digits.size() >= b.digits.size() ? b : a;
+    dest.digits.assign(longer.digits.begin(), longer.digits.end());
+    dest.digits.push_back(0);
+    addArray (&dest.digits[0], &shorter.digits[0], shorter.digits.size());
+    dest.normalize();
+  }
+}
+
+// dest = a - b
+void PosInt::sub (PosInt& dest, const PosInt& a, const PosInt& b) {
+  if (&dest == &a) dest.sub(b);
+  else if (&dest == &b) {
+    PosInt diff(a);
+    diff.sub(b);
+    dest = std::move(diff);
+  }
+  else {
+    STATS_OP(STATS_SUB);
+    if (a.compare(b) < 0)
+      throw MPError("Subtraction would result in negative number");
+    dest.digits.assign(a.digits.begin(), a.digits.end());
+    if (b.digits.size() > 0) {
+      subArray (&dest.digits[0], &b.digits[0], b.digits.size());
+      dest.normalize();
+    }
+  }
+}
+
 /******************** MULTIPLICATION ********************/
 
+// Operand lengths at which multiplication moves on to the next
+// algorithm. The defaults are measured by "make tune".
+static PosInt::MulThresholds mulThresholds = 
+  { KARATSUBA_THRESHOLD, TOOM3_THRESHOLD, TOOM4_THRESHOLD, NTT_THRESHOLD };
+
+PosInt::MulThresholds PosInt::getMulThresholds () {
+  return mulThresholds;
+}
+
+void PosInt::setMulThresholds (const MulThresholds& t) {
+  if (t.karatsuba < 2 || t.toom3 < 7 || t.toom4 < 13 || t.ntt < 1)
+    throw MPError("Multiplication threshold is too small");
+  mulThresholds = t;
+}
+
+// The pool for parallel multiplication (NULL when it is off), the
+// pool that PosInt created itself in setThreads if any, and the
+// operand length below which products are no longer split into tasks.
+static ThreadPool* threadPool = NULL;
+static ThreadPool* ownedPool = NULL;
+static int parallelGrain = 1000;
+
+void PosInt::setThreads (int threads) {
+  if (threads < 0)
+    throw MPError("Can't use a negative number of threads");
+  ThreadPool* old = ownedPool;
+  ownedPool = (threads == 1) ? NULL : new ThreadPool(threads);
+  threadPool = ownedPool;
+  delete old;
+}
+
+void PosInt::setThreadPool (ThreadPool* pool) {
+  ThreadPool* old = ownedPool;
+  ownedPool = NULL;
+  threadPool = pool;
+  delete old;
+}
+
+ThreadPool* PosInt::getThreadPool () {
+  return threadPool;
+}
+
+void PosInt::setParallelGrain (int len) {
+  if (len < 2)
+    throw MPError("Parallel grain size is too small");
+  parallelGrain = len;
+}
+
+// Returns true if products of the given length should be split
+// into tasks on the thread pool
+static bool useParallel (int len) {
+  return threadPool != NULL && threadPool->size() > 1 && len >= parallelGrain;
+}
+
+// Number of jobs a worker claims at a time in the batch operations.
+// Stepping the jobs of a block together, so that their independent
+// products overlap, measured no faster than doing them one by one.
+static const int batchBlock = 4;
+
+// Runs job(i) for each i in [0, count). On the thread pool, each
+// worker makes its own copy of job and claims blocks of batchBlock
+// jobs until none are left, so whatever buffers job keeps are set up
+// once per worker and reused for all of its jobs.
+template <class Job>
+static void runBatch (int count, const Job& job) {
+  if (threadPool == NULL || threadPool->size() <= 1 || count <= batchBlock) {
+    Job mine (job);
+    for (int i=0; i<count; ++i) mine(i);
+    return;
+  }
+
+  atomic<int> next (0);
+  int workers = min(threadPool->size(), (count + batchBlock - 1) / batchBlock);
+  TaskGroup group(*threadPool);
+  for (int t=0; t<workers; ++t)
+    group.run([&] {
+      Job mine (job);
+      for (int b; (b = next.fetch_add(batchBlock)) < count; )
+        for (int i = b; i < min(b + batchBlock, count); ++i) mine(i);
+    });
+  group.wait();
+}
+
+// Adds x * y into the three-digit column accumulator (acc, top).
+static inline void mulAccumulate 
+  (PosInt::DDigit& acc, PosInt::Digit& top, PosInt::Digit x, PosInt::Digit y)
+{
+  PosInt::DDigit prod = (PosInt::DDigit)x * y;
+  acc += prod;
+  top += (acc < prod);
+}
+
+// Schoolbook product of two N-digit arrays, one column at a time.
+// With N fixed the loops unroll completely and the operands stay
+// in registers; GCC needs to be told to unroll the inner one.
+template <int N>
+static void mulFixed 
+  (PosInt::Digit* dest, const PosInt::Digit* x, const PosInt::Digit* y)
+{
+  PosInt::DDigit acc = 0;
+  PosInt::Digit top = 0;
+#pragma GCC unroll 16
+  for (int k=0; k<2*N-1; ++k) {
+#pragma GCC unroll 16
+    for (int i = (k < N ? 0 : k-N+1); i <= k && i < N; ++i)
+      mulAccumulate(acc, top, x[i], y[k-i]);
+    dest[k] = (PosInt::Digit)acc;
+    acc = (acc >> 64) | ((PosInt::DDigit)top << 64);
+    top = 0;
+  }
+  dest[2*N-1] = (PosInt::Digit)acc;
+}
+
 // Computes dest = x * y, digit-wise.
 // x has length xlen and y has length ylen.
-// dest must have size (xlen+ylen) to store the result.
-// Uses standard O(n^2)-time multiplication.
+// dest must have size (xlen+ylen) to store the result, and must not
+// overlap x or y.
+// Uses standard O(n^2)-time multiplication, scanning the product one
+// column at a time: every x[i]*y[j] with i+j = k is summed into a
+// three-digit accumulator, so each column's carry is handled once.
 void PosInt::mulArray 
-  (int* dest, const int* x, int xlen, const int* y, int ylen) 
+  (Digit* dest, const Digit* x, int xlen, const Digit* y, int ylen) 
 {
-  for (int i=0; i<xlen+ylen; ++i) dest[i] = 0;
-  for (int i=0; i<xlen; ++i) {
-    for (int j=0; j<ylen; ++j) {
-      dest[i+j] += x[i] * y[j];
-      dest[i+j+1] += dest[i+j] / B;
-      dest[i+j] %= B;
+  STATS_KERNEL(STATS_MUL_ARRAY, xlen + ylen);
+  if (xlen == ylen) {
+    switch (xlen) {
+      case 1: mulFixed<1>(dest, x, y); return;
+      case 2: mulFixed<2>(dest, x, y); return;
+      case 3: mulFixed<3>(dest, x, y); return;
+      case 4: mulFixed<4>(dest, x, y); return;
+      case 6: mulFixed<6>(dest, x, y); return;
+      case 8: mulFixed<8>(dest, x, y); return;
     }
   }
+  if (xlen == 0 || ylen == 0) {
+    for (int i=0; i<xlen+ylen; ++i) dest[i] = 0;
+    return;
+  }
+
+  DDigit acc = 0;
+  Digit top = 0;
+  for (int k=0; k<xlen+ylen-1; ++k) {
+    int lo = k < ylen ? 0 : k-ylen+1;
+    int hi = k < xlen ? k : xlen-1;
+    for (int i=lo; i<=hi; ++i)
+      mulAccumulate(acc, top, x[i], y[k-i]);
+    dest[k] = (Digit)acc;
+    acc = (acc >> 64) | ((DDigit)top << 64);
+    top = 0;
+  }
+  dest[xlen+ylen-1] = (Digit)acc;
+}
+
+// Returns the number of scratch digits that fastMulArray needs
+// for operands of the given length.
+int PosInt::fastMulScratch (int len) {
+  if (len < mulThresholds.karatsuba) return 0;
+  int hsize = len - len/2;
+  return 6*hsize + 1 + fastMulScratch(hsize);
+}
+
+// Computes dest = |x - y|, digit-wise, and returns true if x < y.
+// x has length xlen and y has length ylen, with both at most len,
+// and dest has length len.
+bool PosInt::absDiffArray 
+  (Digit* dest, const Digit* x, int xlen, const Digit* y, int ylen, int len)
+{
+  bool neg = compareDigits(x, xlen, y, ylen) < 0;
+  if (neg) {
+    std::swap(x, y);
+    std::swap(xlen, ylen);
+  }
+  for (int i=0; i<xlen; ++i) dest[i] = x[i];
+  for (int i=xlen; i<len; ++i) dest[i] = 0;
+  subArray(dest, y, ylen);
+  return neg;
 }
 
 // Computes dest = x * y, digit-wise, using Karatsuba's method.
 // x and y have the same length (len)
 // dest must have size (2*len) to store the result.
-void PosInt::fastMulArray (int* dest, const int* x, const int* y, int len) {
-
-
-  // Karatsuba's method goes here
-
-  // Base Case - when lengths are = 1
-  if ( len == 1 ){
-      
-        // Calls mullArray with single digit numbers
-        mulArray( dest , x , len , y , len);
-       
-  }
-
-  // Recursive Call
-  else{
-        
-        // Splitting terms in half
-        int halves = len / 2;
-        
-        // Creating int arrays with len * 2
-        // for space to add the two terms later
-        int * x_high = new int[len * 2];
-        int * x_low = new int[len * 2];
-       
-        int high_i = 0;
-        int low_i = 0;
-        
-        // Copying over values of x into respective
-        // high and lows
-        for (int i  = 0 ; i < len ; i++ ){
-                if (i < halves) {
-                        x_low[low_i] = x[i];
-                        low_i ++;
-                }
-                else{
-                        x_high[high_i] = x[i];
-                        high_i ++;
-                }
-        }
-
-
-        // Padding x's with 0s
-        for (int i = high_i; i < len; i++){
-                x_high[high_i] = 0;
-        }
-        for (int i = low_i; i < len; i++){
-                x_low[low_i] = 0 ;
-        }
-
-        int * y_high = new int[len * 2];
-        int * y_low = new int[len * 2];
-         
-        high_i = 0;
-        low_i = 0;
-        
-        // Copying over y values to high and lows
-        for (int i  = 0 ; i < len ; i++ ){
-
-                if (i < halves) {
-                        y_low[low_i] = y[i];
-                        low_i ++;
-                }
-                else{
-                        y_high[high_i] = y[i];
-                        high_i ++;
-                }
-        }
-  
-        // Padding for zeros
-        for (int i = high_i; i < len; i ++){
-                y_high[high_i] = 0;
-        }
-        for (int i = low_i; i < len; i ++){
-                y_low[low_i] = 0; 
-        }
-
-
-        // First recursive call - Highs
-        
-        // When a and e are multiplied 
-        // to the base, it can be at most
-        // len * 2 + 1 
-        int * a = new int[len * 3];
-        int * d = new int[len * 3];
-        int * e = new int[len * 3];
-
-        // Setting to zeros, and padding
-        for (int i = 0 ; i < len * 2; i++){
-                a[i] = 0;
-                d[i] = 0;
-                e[i] = 0;
-        }
-
-        // Recursive calls for a and d
-        fastMulArray(a, x_high, y_high, halves);
-        fastMulArray(d, x_low, y_low, halves);
-
-        // Preparing values for recursive call for e
-        addArray(x_low, x_high, len * 2);
-        addArray(y_low, y_high, len * 2);
-
-        // When e can be two numbers of different
-        // digit sizes, we split and call according to
-        // the nearest power or 2 number
-	int e_len = len-1;
-	while( x_low[e_len] == 0 && y_low[e_len] == 0){
-		e_len--;
-	}
-	e_len = (e_len+1 > (len/2) )? len: halves;
-
-        // recursive call for e
-        fastMulArray(e, x_low, y_low, e_len); 
-
-
-        // Base nultiplication for
-        // B ^ len and B ^ halves
-        int base_len = B;        
-        for (int i = 1; i < len ; i ++ ){
-                base_len *= B; 
-        }
-        
-        int base_half = B;
-        for (int i = 1; i < halves ; i ++ ){
-                base_half *= B;
-        }
-
-        // Math for prod=
-        // (a * B ^len) + ((e-a-d) * B ^ halves)+ d
-        
-        // (e-a-d) 
-        subArray(e, a, len * 2);
-        subArray(e, d, len * 2);        
-
-        // a and e multiplied to its base
-        mulDigit(a, base_len, len * 2);
-        mulDigit(e, base_half, len * 2);
-        
-        // adding all to dest ptr
-        addArray(dest, a, len * 2);
-        addArray(dest, e, len * 2);
-        addArray(dest, d, len * 2);
-
-	/* clean up */
-        delete[] a;
-        delete[] e;
-        delete[] d;
-        delete[] x_high;
-        delete[] x_low;
-        delete[] y_high;
-        delete[] y_low;
-
-  }
-  
+// scratch must have size fastMulScratch(len); no other memory is used.
+void PosInt::fastMulArray 
+  (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch)
+{
+  // Base Case - schoolbook below the threshold
+  if (len < mulThresholds.karatsuba) {
+    mulArray(dest, x, len, y, len);
+    return;
+  }
+  STATS_KERNEL(STATS_FAST_MUL_ARRAY, len);
+  STATS_DEPTH();
+
+  // Split into low halves of size l and high halves of size h,
+  // just by pointing into x and y.
+  int l = len / 2;
+  int h = len - l;
+  const Digit* xhigh = x + l;
+  const Digit* yhigh = y + l;
+
+  // Scratch layout: |xl-xh|, |yl-yh|, their product, the middle term,
+  // and then the space for the recursive calls.
+  Digit* dx = scratch;
+  Digit* dy = dx + h;
+  Digit* m = dy + h;
+  Digit* t = m + 2*h;
+  Digit* rest = t + 2*h + 1;
+
+  // Low and high products go straight into dest
+  fastMulArray(dest, x, y, l, rest);
+  fastMulArray(dest + 2*l, xhigh, yhigh, h, rest);
+
+  // m = (xl - xh) * (yl - yh), which has sign neg
+  bool neg = absDiffArray(dx, x, l, xhigh, h, h);
+  neg ^= absDiffArray(dy, y, l, yhigh, h, h);
+  fastMulArray(m, dx, dy, h, rest);
+
+  // Middle term is xl*yh + xh*yl = low + high - m
+  for (int i=0; i<2*l; ++i) t[i] = dest[i];
+  for (int i=2*l; i<=2*h; ++i) t[i] = 0;
+  addArray(t, dest + 2*l, 2*h);
+  if (neg) addArray(t, m, 2*h);
+  else subArray(t, m, 2*h);
+
+  // Multiplying by B^l is just an offset into dest
+  addArray(dest + l, t, 2*h + 1);
+}
 
+/* Helpers for the Toom-Cook kernels. Values that can go negative
+ * during evaluation and interpolation are held in fixed-length
+ * arrays in two's complement, so every operation wraps mod B^len.
+ */
 
+// dest += x * d, mod B^len, where x has length xlen <= len
+static void addMulWrap 
+  (PosInt::Digit* dest, const PosInt::Digit* x, int xlen, PosInt::Digit d, int len)
+{
+  PosInt::Digit carry = 0;
+  int i;
+  for (i=0; i<xlen; ++i) {
+    PosInt::DDigit prod = (PosInt::DDigit)x[i] * d + dest[i] + carry;
+    dest[i] = (PosInt::Digit)prod;
+    carry = (PosInt::Digit)(prod >> 64);
+  }
+  for (; i<len && carry; ++i) {
+    dest[i] += carry;
+    carry = (dest[i] < carry);
+  }
 }
 
-// this = this * x
-void PosInt::mul(const PosInt& x) {
-  if (this == &x) {
-    PosInt xcopy(x);
-    mul(xcopy);
-    return;
+// dest -= x * d, mod B^len, where x has length xlen <= len
+static void subMulWrap 
+  (PosInt::Digit* dest, const PosInt::Digit* x, int xlen, PosInt::Digit d, int len)
+{
+  PosInt::Digit borrow = 0;
+  int i;
+  for (i=0; i<xlen; ++i) {
+    PosInt::DDigit prod = (PosInt::DDigit)x[i] * d + borrow;
+    PosInt::Digit low = (PosInt::Digit)prod;
+    borrow = (PosInt::Digit)(prod >> 64) + (dest[i] < low);
+    dest[i] -= low;
   }
-
-  int mylen = digits.size();
-  int xlen = x.digits.size();
-  if (mylen == 0 || xlen == 0) {
-    set(0);
-    return;
+  for (; i<len && borrow; ++i) {
+    PosInt::Digit old = dest[i];
+    dest[i] -= borrow;
+    borrow = (old < borrow);
   }
+}
 
-  int* mycopy = new int[mylen];
-  for (int i=0; i<mylen; ++i) mycopy[i] = digits[i];
-  digits.resize(mylen + xlen);
-  mulArray(&digits[0], mycopy, mylen, &x.digits[0], xlen);
-
-  normalize();
-  delete [] mycopy;
-}
-
-// this = this * x, using Karatsuba's method
-void PosInt::fastMul(const PosInt& x) {	
-
-	clock_t start = clock();	
-
-	cout << "clock start " << start << endl;
-
-
-        // For numbers with different digit amounts
-        int length = max(digits.size(), x.digits.size());
-
-        // reserving space for large multiplication
-        int* dest = new int[length * 2]; 
-       
-        // Padding
-        for ( int i = 0; i < length * 2; i ++){
-                dest[i] = 0;
-        }
-
-        // For powers of 2, finding and padding
-        // so each split will be an even number
-        int digit_length = 2;
-
-        for (int i = 0; i < length/2 ; i ++){
-            digit_length *=2;
-        }
-        
-        int * x_iarray = new int[digit_length];
-        int * y_iarray = new int[digit_length];
-
-        // Copying over values and padding
-        for (int i = 0 ; i < digit_length ; i++){
-            if (i < x.digits.size() ){
-                x_iarray[i] = x.digits[i];
-            }
-            else{
-                x_iarray[i] = 0;
-            }
-        }
-
-        // Copying over values and padding
-        for (int i = 0 ; i < digit_length ; i++){
-            if (i < digits.size()) {
-                y_iarray[i] = this->digits[i];
-            }
-            else{
-                y_iarray[i] = 0;
-            }
-        }
- 
-        // Call to recursive function
-        fastMulArray(dest, x_iarray, y_iarray, digit_length);
- 
-        cout << "Final Answer: " ;
-       	int i = (length*2) - 1;
-	for ( ; i >= 0; i-- ) {
-                cout << dest[i];
-        }
-
-	clock_t stop = clock();
-	
-	cout << "clock stop " << stop << endl;
-
-	cout << endl;
-
-	double exec_time = (stop-start)/(CLOCKS_PER_SEC);
-	cout << "Execution time: " << exec_time << endl;
-	
-        cout << endl;
-	cout << endl;
- 	       
+// dest = -dest, mod B^len
+static void negWrap (PosInt::Digit* dest, int len) {
+  int i = 0;
+  for (; i<len && dest[i] == 0; ++i);
+  if (i < len) dest[i] = -dest[i];
+  for (++i; i<len; ++i) dest[i] = ~dest[i];
 }
 
-/******************** DIVISION ********************/
+// dest = dest / 2^bits, for a two's complement dest that is
+// divisible by 2^bits, with 0 < bits < 64
+static void shrWrap (PosInt::Digit* dest, int bits, int len) {
+  for (int i=0; i+1<len; ++i)
+    dest[i] = (dest[i] >> bits) | (dest[i+1] << (64-bits));
+  dest[len-1] = (PosInt::Digit)((int64_t)dest[len-1] >> bits);
+}
 
-// Computes dest = dest * d, digit-wise
-// REQUIREMENT: dest has enough space to hold any overflow.
-void PosInt::mulDigit (int* dest, int d, int len) {
-  int i;
-  for (i=0; i<len; ++i)
-    dest[i] *= d;
-  for (i=0; i+1<len; ++i) {
-    dest[i+1] += dest[i] / B;
-    dest[i] %= B;
-  }
-  for (; dest[i] >= B; ++i) {
-    dest[i+1] += dest[i] / B;
-    dest[i] %= B;
+// dest = dest / d, for an odd d that divides the two's complement
+// value in dest exactly. Uses Hensel division by the inverse of d.
+static void divExactWrap (PosInt::Digit* dest, PosInt::Digit d, int len) {
+  PosInt::Digit inv = inverseDigit(d);
+  PosInt::Digit borrow = 0;
+  for (int i=0; i<len; ++i) {
+    PosInt::Digit cur = dest[i];
+    PosInt::Digit q = (cur - borrow) * inv;
+    dest[i] = q;
+    borrow = (PosInt::Digit)(((PosInt::DDigit)q * d) >> 64) + (cur < borrow);
   }
 }
 
-// Computes dest = dest / d, digit-wise, and returns dest % d
-int PosInt::divDigit (int* dest, int d, int len) {
-  int r = 0;
-  for (int i = len-1; i >= 0; --i) {
-    dest[i] += B*r;
-    r = dest[i] % d;
-    dest[i] /= d;
+// Evaluates x, split into parts-1 pieces of length k and a top piece of
+// length s, at a point given by the coefficient for each piece.
+// The result goes in dest in two's complement with length len.
+static void toomEvaluate (PosInt::Digit* dest, int len, 
+  const PosInt::Digit* x, int k, int s, int parts, const int* coef)
+{
+  for (int i=0; i<len; ++i) dest[i] = 0;
+  for (int j=0; j<parts; ++j) {
+    int piecelen = (j+1 < parts) ? k : s;
+    if (coef[j] > 0) addMulWrap(dest, x + j*k, piecelen, coef[j], len);
+    else subMulWrap(dest, x + j*k, piecelen, -coef[j], len);
   }
-  return r;
 }
 
-// Computes division with remainder, digit-wise.
-// REQUIREMENTS: 
-//   - length of q is at least xlen-ylen+1
-//   - length of r is at least xlen
-//   - q and r are distinct from all other arrays
-//   - most significant digit of divisor (y) is at least B/2
-void PosInt::divremArray 
-  (int* q, int* r, const int* x, int xlen, const int* y, int ylen)
+// Computes dest = e * f, where e and f are two's complement values of
+// length len+1 whose magnitudes fit in len digits. dest has length
+// 2*len, and the product is left in two's complement in it.
+// e and f are overwritten with their absolute values.
+// If e and f are the same array, this squares it.
+void PosInt::toomPointMul 
+  (Digit* dest, Digit* e, Digit* f, int len, Digit* scratch)
 {
-  // Copy x into r
-  for (int i=0; i<xlen; ++i) r[i] = x[i];
+  if (e == f) {
+    if (e[len] >> 63) negWrap(e, len+1);
+    balancedSqrArray(dest, e, len, scratch);
+    return;
+  }
 
-  // Create temporary array to hold a digit-multiple of y
-  int* temp = new int[ylen+1];
+  bool neg = false;
+  if (e[len] >> 63) {
+    negWrap(e, len+1);
+    neg = !neg;
+  }
+  if (f[len] >> 63) {
+    negWrap(f, len+1);
+    neg = !neg;
+  }
+  balancedMulArray(dest, e, f, len, scratch);
+  if (neg) negWrap(dest, 2*len);
+}
 
-  int qind = xlen - ylen;
-  int rind = xlen - 1;
+// Returns the number of scratch digits that toom3MulArray needs
+int PosInt::toom3Scratch (int len) {
+  int k = (len + 2) / 3;
+  int s = len - 2*k;
+  int child = max(balancedMulScratch(k), balancedMulScratch(k+1));
+  child = max(child, balancedMulScratch(s));
+  return 2*(k+2) + 3*(2*k+2) + child;
+}
 
-  q[qind] = 0;
-  while (true) {
-    // Do "correction" if the quotient digit is off by a few
+// Computes dest = x * y, digit-wise, using Toom-Cook 3-way.
+// x and y have the same length (len), which must be at least 7.
+// If x and y are the same array, the evaluations are squared.
+// dest must have size (2*len) to store the result.
+// scratch must have size toom3Scratch(len).
+// The pieces of x and y are evaluated at 0, 1, -1, 2 and infinity.
+void PosInt::toom3MulArray 
+  (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch)
+{
+  STATS_KERNEL(STATS_TOOM3_MUL_ARRAY, len);
+  static const int points[3][3] = { {1,1,1}, {1,-1,1}, {1,2,4} };
+
+  int k = (len + 2) / 3;
+  int s = len - 2*k;
+  int m = k + 1;   // length of each evaluation's magnitude
+  int w = 2*m;     // length of each point product
+
+  Digit* ex = scratch;
+  Digit* ey = ex + m+1;
+  Digit* r1 = ey + m+1;
+  Digit* rm1 = r1 + w;
+  Digit* r2 = rm1 + w;
+  Digit* rest = r2 + w;
+
+  // The products at 0 and infinity are the lowest and highest
+  // coefficients c0 and c4, so they go straight into dest.
+  Digit* c0 = dest;
+  Digit* c4 = dest + 4*k;
+  bool square = (x == y);
+  if (square) {
+    balancedSqrArray(c0, x, k, rest);
+    balancedSqrArray(c4, x + 2*k, s, rest);
+  }
+  else {
+    balancedMulArray(c0, x, y, k, rest);
+    balancedMulArray(c4, x + 2*k, y + 2*k, s, rest);
+  }
+  for (int i=2*k; i<4*k; ++i) dest[i] = 0;
+
+  Digit* prods[3] = { r1, rm1, r2 };
+  for (int p=0; p<3; ++p) {
+    toomEvaluate(ex, m+1, x, k, s, 3, points[p]);
+    if (!square) toomEvaluate(ey, m+1, y, k, s, 3, points[p]);
+    toomPointMul(prods[p], ex, square ? ex : ey, m, rest);
+  }
+
+  // Interpolation. Odd and even coefficients are separated from the
+  // values at 1 and -1, then the value at 2 splits c1 from c3.
+  negWrap(rm1, w);
+  addMulWrap(rm1, r1, w, 1, w);
+  shrWrap(rm1, 1, w);                  // rm1 = c1 + c3
+  subMulWrap(r1, rm1, w, 1, w);
+  subMulWrap(r1, c0, 2*k, 1, w);
+  subMulWrap(r1, c4, 2*s, 1, w);       // r1 = c2
+  subMulWrap(r2, c0, 2*k, 1, w);
+  subMulWrap(r2, r1, w, 4, w);
+  subMulWrap(r2, c4, 2*s, 16, w);
+  shrWrap(r2, 1, w);                   // r2 = c1 + 4*c3
+  subMulWrap(r2, rm1, w, 1, w);
+  divExactWrap(r2, 3, w);              // r2 = c3
+  subMulWrap(rm1, r2, w, 1, w);        // rm1 = c1
+
+  Digit* coefs[3] = { rm1, r1, r2 };
+  for (int i=1; i<=3; ++i)
+    addArray(dest + i*k, coefs[i-1], min(w, 2*len - i*k));
+}
+
+// Returns the number of scratch digits that toom4MulArray needs
+int PosInt::toom4Scratch (int len) {
+  int k = (len + 3) / 4;
+  int s = len - 3*k;
+  int child = max(balancedMulScratch(k), balancedMulScratch(k+1));
+  child = max(child, balancedMulScratch(s));
+  return 2*(k+2) + 5*(2*k+2) + child;
+}
+
+// Computes dest = x * y, digit-wise, using Toom-Cook 4-way.
+// x and y have the same length (len), which must be at least 13.
+// If x and y are the same array, the evaluations are squared.
+// dest must have size (2*len) to store the result.
+// scratch must have size toom4Scratch(len).
+// The pieces of x and y are evaluated at 0, 1, -1, 2, -2, 1/2 and
+// infinity, where the value at 1/2 is scaled up by 2^3.
+void PosInt::toom4MulArray 
+  (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch)
+{
+  STATS_KERNEL(STATS_TOOM4_MUL_ARRAY, len);
+  static const int points[5][4] = 
+    { {1,1,1,1}, {1,-1,1,-1}, {1,2,4,8}, {1,-2,4,-8}, {8,4,2,1} };
+
+  int k = (len + 3) / 4;
+  int s = len - 3*k;
+  int m = k + 1;   // length of each evaluation's magnitude
+  int w = 2*m;     // length of each point product
+
+  Digit* ex = scratch;
+  Digit* ey = ex + m+1;
+  Digit* r1 = ey + m+1;
+  Digit* rm1 = r1 + w;
+  Digit* r2 = rm1 + w;
+  Digit* rm2 = r2 + w;
+  Digit* rh = rm2 + w;
+  Digit* rest = rh + w;
+
+  // The products at 0 and infinity are the lowest and highest
+  // coefficients c0 and c6, so they go straight into dest.
+  Digit* c0 = dest;
+  Digit* c6 = dest + 6*k;
+  bool square = (x == y);
+  if (square) {
+    balancedSqrArray(c0, x, k, rest);
+    balancedSqrArray(c6, x + 3*k, s, rest);
+  }
+  else {
+    balancedMulArray(c0, x, y, k, rest);
+    balancedMulArray(c6, x + 3*k, y + 3*k, s, rest);
+  }
+  for (int i=2*k; i<6*k; ++i) dest[i] = 0;
+
+  Digit* prods[5] = { r1, rm1, r2, rm2, rh };
+  for (int p=0; p<5; ++p) {
+    toomEvaluate(ex, m+1, x, k, s, 4, points[p]);
+    if (!square) toomEvaluate(ey, m+1, y, k, s, 4, points[p]);
+    toomPointMul(prods[p], ex, square ? ex : ey, m, rest);
+  }
+
+  // Interpolation. The values at 1, -1 and at 2, -2 are separated
+  // into even and odd parts, which give c2 and c4 directly. The three
+  // odd sums from 1, 2 and 1/2 then solve for c1, c3 and c5.
+  negWrap(rm1, w);
+  addMulWrap(rm1, r1, w, 1, w);
+  shrWrap(rm1, 1, w);                  // rm1 = c1 + c3 + c5
+  subMulWrap(r1, rm1, w, 1, w);
+  subMulWrap(r1, c0, 2*k, 1, w);
+  subMulWrap(r1, c6, 2*s, 1, w);       // r1 = c2 + c4
+  negWrap(rm2, w);
+  addMulWrap(rm2, r2, w, 1, w);
+  shrWrap(rm2, 2, w);                  // rm2 = c1 + 4*c3 + 16*c5
+  subMulWrap(r2, rm2, w, 2, w);
+  subMulWrap(r2, c0, 2*k, 1, w);
+  subMulWrap(r2, c6, 2*s, 64, w);
+  shrWrap(r2, 2, w);                   // r2 = c2 + 4*c4
+  subMulWrap(r2, r1, w, 1, w);
+  divExactWrap(r2, 3, w);              // r2 = c4
+  subMulWrap(r1, r2, w, 1, w);         // r1 = c2
+  subMulWrap(rh, c0, 2*k, 64, w);
+  subMulWrap(rh, r1, w, 16, w);
+  subMulWrap(rh, r2, w, 4, w);
+  subMulWrap(rh, c6, 2*s, 1, w);
+  shrWrap(rh, 1, w);                   // rh = 16*c1 + 4*c3 + c5
+  subMulWrap(rm2, rm1, w, 1, w);
+  divExactWrap(rm2, 3, w);             // rm2 = c3 + 5*c5
+  subMulWrap(rh, rm1, w, 1, w);
+  divExactWrap(rh, 3, w);              // rh = 5*c1 + c3
+  addMulWrap(rh, rm2, w, 4, w);
+  subMulWrap(rh, rm1, w, 5, w);
+  divExactWrap(rh, 15, w);             // rh = c5
+  subMulWrap(rm2, rh, w, 5, w);        // rm2 = c3
+  subMulWrap(rm1, rm2, w, 1, w);
+  subMulWrap(rm1, rh, w, 1, w);        // rm1 = c1
+
+  Digit* coefs[5] = { rm1, r1, rm2, r2, rh };
+  for (int i=1; i<=5; ++i)
+    addArray(dest + i*k, coefs[i-1], min(w, 2*len - i*k));
+}
+
+// Returns the number of scratch digits that balancedMulArray needs
+int PosInt::balancedMulScratch (int len) {
+  if (len >= mulThresholds.toom4) return toom4Scratch(len);
+  else if (len >= mulThresholds.toom3) return toom3Scratch(len);
+  else return fastMulScratch(len);
+}
+
+// Computes dest = x * y, digit-wise, where x and y have the same
+// length, using whichever of Karatsuba, Toom-3 or Toom-4 suits len.
+// scratch must have size balancedMulScratch(len).
+void PosInt::balancedMulArray 
+  (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch)
+{
+  if (len >= mulThresholds.toom4) toom4MulArray(dest, x, y, len, scratch);
+  else if (len >= mulThresholds.toom3) toom3MulArray(dest, x, y, len, scratch);
+  else fastMulArray(dest, x, y, len, scratch);
+}
+
+/* Number-theoretic transform multiplication. The convolution of the
+ * digits is computed modulo three primes c*2^45 + 1 just under 2^63,
+ * whose product is big enough to hold every coefficient exactly, and
+ * then recombined with the Chinese remainder theorem. Residues are
+ * kept in Montgomery form so that no modular product needs a division.
+ */
+
+struct NttPrime {
+  PosInt::Digit p;      // the prime itself
+  PosInt::Digit pinv;   // -p^(-1) mod 2^64
+  PosInt::Digit r2;     // 2^128 mod p
+  PosInt::Digit g;      // a generator of the multiplicative group
+};
+
+static NttPrime makeNttPrime (PosInt::Digit p, PosInt::Digit g) {
+  NttPrime P;
+  P.p = p;
+  P.g = g;
+  P.pinv = -inverseDigit(p);
+  PosInt::DDigit r = ((PosInt::DDigit)1 << 64) % p;
+  P.r2 = (PosInt::Digit)((r * r) % p);
+  return P;
+}
+
+static const NttPrime* nttPrimes () {
+  static const NttPrime primes[3] = {
+    makeNttPrime (0x7fffe00000000001ULL, 5),
+    makeNttPrime (0x7ff5a00000000001ULL, 3),
+    makeNttPrime (0x7ff4a00000000001ULL, 5)
+  };
+  return primes;
+}
+
+// Returns a * b / 2^64 mod p. Needs a*b < p * 2^64.
+static inline PosInt::Digit montMul 
+  (PosInt::Digit a, PosInt::Digit b, const NttPrime& P)
+{
+  PosInt::DDigit t = (PosInt::DDigit)a * b;
+  PosInt::Digit m = (PosInt::Digit)t * P.pinv;
+  PosInt::Digit u = (PosInt::Digit)((t + (PosInt::DDigit)m * P.p) >> 64);
+  return u >= P.p ? u - P.p : u;
+}
+
+static inline PosInt::Digit addMod 
+  (PosInt::Digit a, PosInt::Digit b, const NttPrime& P)
+{
+  PosInt::Digit s = a + b;
+  return s >= P.p ? s - P.p : s;
+}
+
+static inline PosInt::Digit subMod 
+  (PosInt::Digit a, PosInt::Digit b, const NttPrime& P)
+{
+  return a >= b ? a - b : a + (P.p - b);
+}
+
+// Returns a^e mod p, with a and the result in Montgomery form
+static PosInt::Digit montPow 
+  (PosInt::Digit a, PosInt::Digit e, const NttPrime& P)
+{
+  PosInt::Digit result = montMul(1, P.r2, P);
+  for (; e > 0; e >>= 1) {
+    if (e & 1) result = montMul(result, a, P);
+    a = montMul(a, a, P);
+  }
+  return result;
+}
+
+// Fills w[0..n/2) with the powers of root, in Montgomery form
+static void nttTable 
+  (PosInt::Digit* w, PosInt::Digit root, int n, const NttPrime& P)
+{
+  if (n < 2) return;
+  w[0] = montMul(1, P.r2, P);
+  for (int j=1; j < n/2; ++j) w[j] = montMul(w[j-1], root, P);
+}
+
+// Forward transform of length n (decimation in frequency). 
+// The output is left in bit-reversed order.
+static void nttForward 
+  (PosInt::Digit* a, const PosInt::Digit* w, int n, const NttPrime& P)
+{
+  for (int half = n/2, stride = 1; half >= 1; half >>= 1, stride <<= 1) {
+    for (int start = 0; start < n; start += 2*half) {
+      PosInt::Digit* lo = a + start;
+      PosInt::Digit* hi = lo + half;
+      for (int j=0; j < half; ++j) {
+        PosInt::Digit u = lo[j];
+        PosInt::Digit v = hi[j];
+        lo[j] = addMod(u, v, P);
+        hi[j] = montMul(subMod(u, v, P), w[j*stride], P);
+      }
+    }
+  }
+}
+
+// Inverse transform of length n (decimation in time), without the
+// final division by n. The input is in bit-reversed order.
+static void nttInverse 
+  (PosInt::Digit* a, const PosInt::Digit* winv, int n, const NttPrime& P)
+{
+  for (int half = 1, stride = n/2; half < n; half <<= 1, stride >>= 1) {
+    for (int start = 0; start < n; start += 2*half) {
+      PosInt::Digit* lo = a + start;
+      PosInt::Digit* hi = lo + half;
+      for (int j=0; j < half; ++j) {
+        PosInt::Digit u = lo[j];
+        PosInt::Digit v = montMul(hi[j], winv[j*stride], P);
+        lo[j] = addMod(u, v, P);
+        hi[j] = subMod(u, v, P);
+      }
+    }
+  }
+}
+
+// Returns the transform length used for the given operand lengths
+static int nttLength (int xlen, int ylen) {
+  int n = 1;
+  while (n < xlen + ylen - 1) n <<= 1;
+  return n;
+}
+
+// Returns the number of scratch digits that nttMulArray needs
+int PosInt::nttScratch (int xlen, int ylen) {
+  return 5 * nttLength(xlen, ylen);
+}
+
+// Computes dest = x * y, digit-wise, using a three-prime NTT.
+// x has length xlen and y has length ylen.
+// If x and y are the same array, only one forward transform is done.
+// dest must have size (xlen+ylen) to store the result.
+// scratch must have size nttScratch(xlen, ylen).
+void PosInt::nttMulArray (Digit* dest, 
+  const Digit* x, int xlen, const Digit* y, int ylen, Digit* scratch)
+{
+  STATS_KERNEL(STATS_NTT_MUL_ARRAY, xlen + ylen);
+  const NttPrime* primes = nttPrimes();
+  bool square = (x == y && xlen == ylen);
+  int clen = xlen + ylen - 1;
+  int n = nttLength(xlen, ylen);
+
+  // Scratch layout: the convolution mod each prime, the transform
+  // of y, and the tables of roots of unity and their inverses.
+  Digit* conv[3] = { scratch, scratch + n, scratch + 2*n };
+  Digit* fy = scratch + 3*n;
+  Digit* w = fy + n;
+  Digit* winv = w + n/2;
+
+  for (int k=0; k<3; ++k) {
+    const NttPrime& P = primes[k];
+    Digit* fx = conv[k];
+    for (int i=0; i<xlen; ++i) fx[i] = montMul(x[i] % P.p, P.r2, P);
+    for (int i=xlen; i<n; ++i) fx[i] = 0;
+    if (!square) {
+      for (int i=0; i<ylen; ++i) fy[i] = montMul(y[i] % P.p, P.r2, P);
+      for (int i=ylen; i<n; ++i) fy[i] = 0;
+    }
+
+    Digit g = montMul(P.g, P.r2, P);
+    Digit root = montPow(g, (P.p - 1) / n, P);
+    nttTable(w, root, n, P);
+    nttTable(winv, montPow(root, n-1, P), n, P);
+
+    nttForward(fx, w, n, P);
+    if (square) {
+      for (int i=0; i<n; ++i) fx[i] = montMul(fx[i], fx[i], P);
+    }
+    else {
+      nttForward(fy, w, n, P);
+      for (int i=0; i<n; ++i) fx[i] = montMul(fx[i], fy[i], P);
+    }
+    nttInverse(fx, winv, n, P);
+
+    // Multiplying by n^(-1) in plain form also leaves Montgomery form
+    Digit ninv = montMul(montPow(montMul(n, P.r2, P), P.p - 2, P), 1, P);
+    for (int i=0; i<clen; ++i) fx[i] = montMul(fx[i], ninv, P);
+  }
+
+  // Garner's form of the CRT: each coefficient is
+  // v1 + p1*v2 + p1*p2*v3, with vk < pk.
+  const NttPrime& P1 = primes[0];
+  const NttPrime& P2 = primes[1];
+  const NttPrime& P3 = primes[2];
+  Digit inv12 = montPow(montMul(P1.p % P2.p, P2.r2, P2), P2.p - 2, P2);
+  Digit p1mod3 = montMul(P1.p % P3.p, P3.r2, P3);
+  Digit inv123 = montPow(montMul(p1mod3, montMul(P2.p % P3.p, P3.r2, P3), P3), 
+                         P3.p - 2, P3);
+  DDigit p12 = (DDigit)P1.p * P2.p;
+  Digit p12lo = (Digit)p12;
+  Digit p12hi = (Digit)(p12 >> 64);
+
+  // Running carry of up to two digits
+  Digit c0 = 0, c1 = 0;
+  for (int i=0; i<clen; ++i) {
+    Digit v1 = conv[0][i];
+    Digit v2 = montMul(subMod(conv[1][i], v1 % P2.p, P2), inv12, P2);
+    Digit low = addMod(v1 % P3.p, montMul(v2, p1mod3, P3), P3);
+    Digit v3 = montMul(subMod(conv[2][i], low, P3), inv123, P3);
+
+    // coef = p1*p2*v3 + (p1*v2 + v1), as three digits
+    DDigit t = (DDigit)P1.p * v2 + v1;
+    DDigit a = (DDigit)p12lo * v3;
+    DDigit b = (DDigit)p12hi * v3;
+    DDigit mid = (a >> 64) + (Digit)b;
+    DDigit sum = (DDigit)(Digit)a + (Digit)t;
+    Digit x0 = (Digit)sum;
+    sum = (sum >> 64) + (Digit)mid + (Digit)(t >> 64);
+    Digit x1 = (Digit)sum;
+    Digit x2 = (Digit)(sum >> 64) + (Digit)(mid >> 64) + (Digit)(b >> 64);
+
+    sum = (DDigit)c0 + x0;
+    dest[i] = (Digit)sum;
+    sum = (sum >> 64) + c1 + x1;
+    c0 = (Digit)sum;
+    c1 = (Digit)(sum >> 64) + x2;
+  }
+  dest[clen] = c0;
+}
+
+// Returns the number of scratch digits that parFastMulArray needs
+int PosInt::parFastMulScratch (int len) {
+  if (len < parallelGrain) return balancedMulScratch(len);
+  int l = len / 2;
+  int h = len - l;
+  int child = max(parFastMulScratch(l), parFastMulScratch(h));
+  return 6*h + 1 + 3*child;
+}
+
+// Computes dest = x * y, digit-wise, using Karatsuba's method with
+// the three recursive products run as tasks on the thread pool.
+// Below the parallel grain size it falls back to balancedMulArray.
+// x and y have the same length (len)
+// dest must have size (2*len) to store the result.
+// scratch must have size parFastMulScratch(len).
+void PosInt::parFastMulArray 
+  (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch)
+{
+  if (len < parallelGrain) {
+    balancedMulArray(dest, x, y, len, scratch);
+    return;
+  }
+  STATS_KERNEL(STATS_PAR_FAST_MUL_ARRAY, len);
+  STATS_DEPTH();
+
+  // Same split and scratch layout as fastMulArray, except that each
+  // recursive product gets its own region of scratch.
+  int l = len / 2;
+  int h = len - l;
+  int child = max(parFastMulScratch(l), parFastMulScratch(h));
+  const Digit* xhigh = x + l;
+  const Digit* yhigh = y + l;
+  Digit* dx = scratch;
+  Digit* dy = dx + h;
+  Digit* m = dy + h;
+  Digit* t = m + 2*h;
+  Digit* rest = t + 2*h + 1;
+
+  bool neg = absDiffArray(dx, x, l, xhigh, h, h);
+  neg ^= absDiffArray(dy, y, l, yhigh, h, h);
+
+  TaskGroup group(*threadPool);
+  group.run([=] { parFastMulArray(dest, x, y, l, rest); });
+  group.run([=] { parFastMulArray(dest + 2*l, xhigh, yhigh, h, rest + child); });
+  parFastMulArray(m, dx, dy, h, rest + 2*child);
+  group.wait();
+
+  for (int i=0; i<2*l; ++i) t[i] = dest[i];
+  for (int i=2*l; i<=2*h; ++i) t[i] = 0;
+  addArray(t, dest + 2*l, 2*h);
+  if (neg) addArray(t, m, 2*h);
+  else subArray(t, m, 2*h);
+  addArray(dest + l, t, 2*h + 1);
+}
+
+// Returns the number of scratch digits that unbalancedMulArray needs
+int PosInt::unbalancedMulScratch (int xlen, int ylen) {
+  int m = min(xlen, ylen);
+  if (m >= mulThresholds.ntt) return nttScratch(xlen, ylen);
+  else if (m >= mulThresholds.karatsuba) return 3*m + balancedMulScratch(m);
+  else return 0;
+}
+
+// Computes dest = x * y, digit-wise, for any lengths xlen and ylen.
+// The longer operand is cut into chunks the length of the shorter,
+// as in fastMul, unless the shorter is small enough for schoolbook
+// or big enough for the NTT.
+// dest must have size (xlen+ylen), and scratch must have size
+// unbalancedMulScratch(xlen, ylen).
+void PosInt::unbalancedMulArray (Digit* dest, 
+  const Digit* x, int xlen, const Digit* y, int ylen, Digit* scratch)
+{
+  if (xlen < ylen) {
+    swap(x, y);
+    swap(xlen, ylen);
+  }
+  int m = ylen;
+  if (m >= mulThresholds.ntt) {
+    nttMulArray(dest, x, xlen, y, ylen, scratch);
+    return;
+  }
+  else if (m < mulThresholds.karatsuba) {
+    mulArray(dest, x, xlen, y, ylen);
+    return;
+  }
+
+  Digit* chunk = scratch;
+  Digit* prod = chunk + m;
+  for (int i=0; i<xlen+ylen; ++i) dest[i] = 0;
+  for (int start = 0; start < xlen; start += m) {
+    const Digit* xchunk = x + start;
+    if (start + m > xlen) {
+      for (int i=0; i < xlen-start; ++i) chunk[i] = xchunk[i];
+      for (int i=xlen-start; i < m; ++i) chunk[i] = 0;
+      xchunk = chunk;
+    }
+    balancedMulArray(prod, xchunk, y, m, prod + 2*m);
+    addArray(dest + start, prod, min(2*m, xlen + m - start));
+  }
+}
+
+// this = this * x
+// Uses schoolbook multiplication for small operands, Karatsuba or
+// Toom-Cook (through fastMul) for medium ones, and the NTT for large.
+void PosInt::mul(const PosInt& x) {
+  STATS_OP(STATS_MUL);
+  if (this == &x) {
+    sqr();
+    return;
+  }
+
+  int mylen = digits.size();
+  int xlen = x.digits.size();
+  int shorter = min(mylen, xlen);
+  if (shorter == 0) {
+    set(0);
+    return;
+  }
+  else if (useParallel(shorter) || 
+           (shorter >= mulThresholds.karatsuba && shorter < mulThresholds.ntt)) {
+    fastMul(x);
+    return;
+  }
+
+  // Move our digits out of the way rather than copying them
+  DigitVector mine (std::move(digits));
+  digits.resize(mylen + xlen);
+  if (shorter >= mulThresholds.ntt) {
+    vector<Digit> scratch (nttScratch(mylen, xlen));
+    STATS_SCRATCH(scratch.size());
+    nttMulArray(&digits[0], &mine[0], mylen, &x.digits[0], xlen, &scratch[0]);
+  }
+  else mulArray(&digits[0], &mine[0], mylen, &x.digits[0], xlen);
+
+  normalize();
+}
+
+// dest = a * b, written straight into dest when it is neither operand
+void PosInt::mul (PosInt& dest, const PosInt& a, const PosInt& b) {
+  if (&dest == &a) {
+    dest.mul(b);
+    return;
+  }
+  else if (&dest == &b) {
+    dest.mul(a);
+    return;
+  }
+  else if (&a == &b) {
+    dest.set(a);
+    dest.sqr();
+    return;
+  }
+
+  STATS_OP(STATS_MUL);
+  int alen = a.digits.size();
+  int blen = b.digits.size();
+  int shorter = min(alen, blen);
+  if (shorter == 0) {
+    dest.set(0);
+    return;
+  }
+  else if (useParallel(shorter)) {
+    dest.set(a);
+    dest.fastMul(b);
+    return;
+  }
+
+  dest.digits.resize(alen + blen);
+  vector<Digit> scratch (unbalancedMulScratch(alen, blen));
+  STATS_SCRATCH(scratch.size());
+  unbalancedMulArray(&dest.digits[0], &a.digits[0], alen, &b.digits[0], blen, 
+                     scratch.empty() ? NULL : &scratch[0]);
+  dest.normalize();
+}
+
+// result[i] = a[i] * b[i] for each i, spread over the thread pool.
+// Each product is done on one thread, into a buffer that is then
+// swapped with result[i], so result may be the same vector as a or b.
+void PosInt::mulBatch (vector<PosInt>& result, 
+  const vector<PosInt>& a, const vector<PosInt>& b)
+{
+  STATS_OP(STATS_MUL_BATCH);
+  if (a.size() != b.size())
+    throw MPError("Batch operands must have the same length");
+  int k = a.size();
+  result.resize(k);
+
+  runBatch(k, [&, scratch = vector<Digit>(), prod = DigitVector()] 
+    (int i) mutable 
+  {
+    int alen = a[i].digits.size();
+    int blen = b[i].digits.size();
+    if (alen == 0 || blen == 0) {
+      result[i].set(0);
+      return;
+    }
+    STATS_SCRATCH(max(0, unbalancedMulScratch(alen, blen) - (int)scratch.capacity()));
+    scratch.resize(unbalancedMulScratch(alen, blen));
+    prod.resize(alen + blen);
+    unbalancedMulArray(&prod[0], &a[i].digits[0], alen, &b[i].digits[0], blen,
+                       scratch.empty() ? NULL : &scratch[0]);
+    result[i].digits.swap(prod);
+    result[i].normalize();
+  });
+}
+
+// this = this * x, using Karatsuba's method, or Toom-Cook
+// for large enough operands. Runs in parallel when a thread pool
+// is set and the operands are at least the parallel grain size.
+void PosInt::fastMul(const PosInt& x) {
+  STATS_OP(STATS_FAST_MUL);
+  if (this == &x) {
+    sqr();
+    return;
+  }
+
+  // a is the longer operand with length n, and b is the shorter
+  // with length m. a is cut into length-m chunks that are each
+  // multiplied by b.
+  const DigitVector& a = digits.size() >= x.digits.size() ? digits : x.digits;
+  const DigitVector& b = digits.size() >= x.digits.size() ? x.digits : digits;
+  int n = a.size();
+  int m = b.size();
+  if (m == 0) {
+    set(0);
+    return;
+  }
+
+  // A single arena holds copies of both operands, the zero-padded
+  // last chunk of a, one chunk product, and the kernels' scratch space.
+  bool parallel = useParallel(m);
+  vector<Digit> arena 
+    (n + 4*m + (parallel ? parFastMulScratch(m) : balancedMulScratch(m)));
+  STATS_SCRATCH(arena.size());
+  Digit* acopy = &arena[0];
+  Digit* bcopy = acopy + n;
+  Digit* chunk = bcopy + m;
+  Digit* prod = chunk + m;
+  Digit* scratch = prod + 2*m;
+  for (int i=0; i<n; ++i) acopy[i] = a[i];
+  for (int i=0; i<m; ++i) bcopy[i] = b[i];
+
+  digits.assign(n + m, 0);
+  for (int start = 0; start < n; start += m) {
+    const Digit* achunk = acopy + start;
+    if (start + m > n) {
+      for (int i=0; i < n-start; ++i) chunk[i] = achunk[i];
+      for (int i=n-start; i < m; ++i) chunk[i] = 0;
+      achunk = chunk;
+    }
+    if (parallel) parFastMulArray(prod, achunk, bcopy, m, scratch);
+    else balancedMulArray(prod, achunk, bcopy, m, scratch);
+    addArray(&digits[start], prod, min(2*m, n + m - start));
+  }
+  normalize();
+}
+
+/******************** SQUARING ********************/
+
+// Computes dest = x * x, digit-wise.
+// x has length len, and dest must have size (2*len).
+// Each cross product x[i]*x[j] with i < j is computed once and
+// doubled, then the squares x[i]^2 are added along the diagonal.
+void PosInt::sqrArray (Digit* dest, const Digit* x, int len) {
+  STATS_KERNEL(STATS_SQR_ARRAY, len);
+  for (int i=0; i<2*len; ++i) dest[i] = 0;
+  for (int i=0; i<len; ++i) {
+    Digit carry = 0;
+    for (int j=i+1; j<len; ++j) {
+      DDigit prod = (DDigit)x[i] * x[j] + dest[i+j] + carry;
+      dest[i+j] = (Digit)prod;
+      carry = (Digit)(prod >> 64);
+    }
+    dest[i+len] = carry;
+  }
+
+  Digit top = 0;
+  for (int i=0; i<2*len; ++i) {
+    Digit next = dest[i] >> 63;
+    dest[i] = (dest[i] << 1) | top;
+    top = next;
+  }
+
+  Digit carry = 0;
+  for (int i=0; i<len; ++i) {
+    DDigit sq = (DDigit)x[i] * x[i];
+    DDigit sum = (DDigit)dest[2*i] + (Digit)sq + carry;
+    dest[2*i] = (Digit)sum;
+    sum = (sum >> 64) + dest[2*i+1] + (Digit)(sq >> 64);
+    dest[2*i+1] = (Digit)sum;
+    carry = (Digit)(sum >> 64);
+  }
+}
+
+// Computes dest = x * x, digit-wise, using Karatsuba's method.
+// x has length len, and dest must have size (2*len).
+// scratch must have size fastMulScratch(len).
+// The middle term is low^2 + high^2 - (low - high)^2, so this needs
+// three recursive squarings and no general products.
+void PosInt::fastSqrArray (Digit* dest, const Digit* x, int len, Digit* scratch) {
+  if (len < mulThresholds.karatsuba) {
+    sqrArray(dest, x, len);
+    return;
+  }
+  STATS_KERNEL(STATS_FAST_SQR_ARRAY, len);
+  STATS_DEPTH();
+
+  int l = len / 2;
+  int h = len - l;
+  const Digit* xhigh = x + l;
+  Digit* dx = scratch;
+  Digit* m = dx + h;
+  Digit* t = m + 2*h;
+  Digit* rest = t + 2*h + 1;
+
+  fastSqrArray(dest, x, l, rest);
+  fastSqrArray(dest + 2*l, xhigh, h, rest);
+  absDiffArray(dx, x, l, xhigh, h, h);
+  fastSqrArray(m, dx, h, rest);
+
+  for (int i=0; i<2*l; ++i) t[i] = dest[i];
+  for (int i=2*l; i<=2*h; ++i) t[i] = 0;
+  addArray(t, dest + 2*l, 2*h);
+  subArray(t, m, 2*h);
+  addArray(dest + l, t, 2*h + 1);
+}
+
+// Computes dest = x * x, digit-wise, using whichever of Karatsuba,
+// Toom-3 or Toom-4 suits len.
+// scratch must have size balancedMulScratch(len).
+void PosInt::balancedSqrArray (Digit* dest, const Digit* x, int len, Digit* scratch) {
+  if (len >= mulThresholds.toom4) toom4MulArray(dest, x, x, len, scratch);
+  else if (len >= mulThresholds.toom3) toom3MulArray(dest, x, x, len, scratch);
+  else fastSqrArray(dest, x, len, scratch);
+}
+
+// this = this * this
+void PosInt::sqr() {
+  STATS_OP(STATS_SQR);
+  int len = digits.size();
+  if (len == 0) return;
+
+  vector<Digit> arena (len);
+  Digit* mycopy = &arena[0];
+  for (int i=0; i<len; ++i) mycopy[i] = digits[i];
+  digits.resize(2*len);
+
+  if (useParallel(len)) {
+    arena.resize(len + parFastMulScratch(len));
+    mycopy = &arena[0];
+    parFastMulArray(&digits[0], mycopy, mycopy, len, mycopy + len);
+  }
+  else if (len >= mulThresholds.ntt) {
+    arena.resize(len + nttScratch(len, len));
+    mycopy = &arena[0];
+    nttMulArray(&digits[0], mycopy, len, mycopy, len, mycopy + len);
+  }
+  else if (len >= mulThresholds.karatsuba) {
+    arena.resize(len + balancedMulScratch(len));
+    mycopy = &arena[0];
+    balancedSqrArray(&digits[0], mycopy, len, mycopy + len);
+  }
+  else sqrArray(&digits[0], mycopy, len);
+  STATS_SCRATCH(arena.size());
+
+  normalize();
+}
+
+/******************** DIVISION ********************/
+
+// Computes dest = dest * d, digit-wise
+// REQUIREMENT: dest has enough space to hold any overflow.
+void PosInt::mulDigit (Digit* dest, Digit d, int len) {
+  STATS_KERNEL(STATS_MUL_DIGIT, len);
+  Digit carry = 0;
+  int i;
+  for (i=0; i<len; ++i) {
+    DDigit prod = (DDigit)dest[i] * d + carry;
+    dest[i] = (Digit)prod;
+    carry = (Digit)(prod >> 64);
+  }
+  for (; carry; ++i) {
+    DDigit sum = (DDigit)dest[i] + carry;
+    dest[i] = (Digit)sum;
+    carry = (Digit)(sum >> 64);
+  }
+}
+
+// Computes dest = dest / d, digit-wise, and returns dest % d
+PosInt::Digit PosInt::divDigit (Digit* dest, Digit d, int len) {
+  STATS_KERNEL(STATS_DIV_DIGIT, len);
+  Digit r = 0;
+  for (int i = len-1; i >= 0; --i) {
+    DDigit cur = ((DDigit)r << 64) | dest[i];
+    dest[i] = (Digit)(cur / d);
+    r = (Digit)(cur % d);
+  }
+  return r;
+}
+
+// Computes division with remainder, digit-wise.
+// REQUIREMENTS: 
+//   - length of q is at least xlen-ylen+1
+//   - length of r is at least xlen
+//   - q and r are distinct from all other arrays
+//   - most significant digit of divisor (y) is at least B/2
+//   - scratch has length at least ylen+1
+void PosInt::divremArray (Digit* q, Digit* r, const Digit* x, int xlen,
+  const Digit* y, int ylen, Digit* scratch)
+{
+  STATS_KERNEL(STATS_DIVREM_ARRAY, xlen + ylen);
+  // Copy x into r
+  for (int i=0; i<xlen; ++i) r[i] = x[i];
+
+  // The scratch holds a digit-multiple of y
+  Digit* temp = scratch;
+
+  int qind = xlen - ylen;
+  int rind = xlen - 1;
+
+  q[qind] = 0;
+  while (true) {
+    // Do "correction" if the quotient digit is off by a few
     while (compareDigits (y, ylen, r + qind, xlen-qind) <= 0) {
       subArray (r + qind, y, ylen);
       ++q[qind];
@@ -612,9 +1977,10 @@ void PosInt::divremArray
     --rind;
 
     // (Under)-estimate the next digit, and subtract out the multiple.
-    int quoest = (r[rind] + B*r[rind+1]) / y[ylen-1] - 2;
-    if (quoest <= 0) q[qind] = 0;
+    DDigit quoest = (((DDigit)r[rind+1] << 64) | r[rind]) / y[ylen-1];
+    if (quoest <= 2) q[qind] = 0;
     else {
+      quoest -= 2;
       q[qind] = quoest;
       for (int i=0; i<ylen; ++i) temp[i] = y[i];
       temp[ylen] = 0;
@@ -622,13 +1988,230 @@ void PosInt::divremArray
       subArray (r+qind, temp, ylen+1);
     }
   }
+}
+
+// Divisor lengths at which division moves on to Burnikel-Ziegler
+// and then Newton's method. The defaults are measured by "make tune".
+static PosInt::DivThresholds divThresholds = 
+  { BZ_THRESHOLD, NEWTON_THRESHOLD };
+
+PosInt::DivThresholds PosInt::getDivThresholds () {
+  return divThresholds;
+}
+
+void PosInt::setDivThresholds (const DivThresholds& t) {
+  if (t.burnikelZiegler < 2 || t.newton < 3)
+    throw MPError("Division threshold is too small");
+  divThresholds = t;
+}
+
+// dest += x, mod B^len, where x has length xlen <= len.
+// Returns the carry out of the top digit.
+static PosInt::Digit addWrap 
+  (PosInt::Digit* dest, const PosInt::Digit* x, int xlen, int len)
+{
+  PosInt::Digit carry = 0;
+  int i;
+  for (i=0; i<xlen; ++i) {
+    PosInt::DDigit sum = (PosInt::DDigit)dest[i] + x[i] + carry;
+    dest[i] = (PosInt::Digit)sum;
+    carry = (PosInt::Digit)(sum >> 64);
+  }
+  for (; i<len && carry; ++i)
+    carry = (++dest[i] == 0);
+  return carry;
+}
+
+// dest -= x, mod B^len, where x has length xlen <= len.
+// Returns the borrow out of the top digit.
+static PosInt::Digit subWrap 
+  (PosInt::Digit* dest, const PosInt::Digit* x, int xlen, int len)
+{
+  PosInt::Digit borrow = 0;
+  int i;
+  for (i=0; i<xlen; ++i) {
+    PosInt::DDigit diff = (PosInt::DDigit)dest[i] - x[i] - borrow;
+    dest[i] = (PosInt::Digit)diff;
+    borrow = (PosInt::Digit)(diff >> 64) & 1;
+  }
+  for (; i<len && borrow; ++i)
+    borrow = (dest[i]-- == 0);
+  return borrow;
+}
+
+static const PosInt::Digit oneDigit = 1;
+
+// Returns the number of scratch digits that bzDivremArray needs
+int PosInt::bzScratch (int n, int r) {
+  if (r < divThresholds.burnikelZiegler) return 2*n + 2*r + 2;
+  else if (r == n) return max(bzScratch(n, n - n/2), bzScratch(n, n/2));
+  else return max(bzScratch(r, r), n + unbalancedMulScratch(r, n - r));
+}
+
+// Divides the n+r digits at np by d, which has length n and its top
+// bit set, where r <= n. The quotient is less than 2*B^r; its low r
+// digits go in q and the top one (0 or 1) is returned. The remainder
+// is left in np[0..n), and the digits above it are garbage.
+// scratch must have size bzScratch(n, r).
+//
+// This is the recursion of Burnikel and Ziegler. When r == n the
+// quotient is found in two halves, each of which is a division of
+// n + n/2 digits by n. Otherwise the top 2r digits of np are divided
+// by the top r digits of d, which gives a quotient at most 2 too big,
+// and the rest of d is subtracted out with a single product.
+PosInt::Digit PosInt::bzDivremArray 
+  (Digit* q, Digit* np, const Digit* d, int n, int r, Digit* scratch)
+{
+  STATS_KERNEL(STATS_BZ_DIVREM_ARRAY, n + r);
+  if (r < divThresholds.burnikelZiegler) {
+    Digit* qtemp = scratch;
+    Digit* rtemp = qtemp + r + 1;
+    divremArray(qtemp, rtemp, np, n + r, d, n, rtemp + n + r);
+    for (int i=0; i<r; ++i) q[i] = qtemp[i];
+    for (int i=0; i<n; ++i) np[i] = rtemp[i];
+    return qtemp[r];
+  }
+  else if (r == n) {
+    int lo = n/2;
+    int hi = n - lo;
+    Digit qh = bzDivremArray(q + lo, np + lo, d, n, hi, scratch);
+    bzDivremArray(q, np, d, n, lo, scratch);
+    return qh;
+  }
+
+  Digit qh = bzDivremArray(q, np + n - r, d + n - r, r, r, scratch);
+
+  // Subtract q times the low n-r digits of d
+  Digit* prod = scratch;
+  unbalancedMulArray(prod, q, r, d, n - r, prod + n);
+  Digit borrow = subWrap(np, prod, n, n);
+  if (qh) borrow += subWrap(np + r, d, n - r, n - r);
+
+  // Add d back while the remainder is negative
+  while (borrow) {
+    qh -= subWrap(q, &oneDigit, 1, r);
+    borrow -= addWrap(np, d, n, n);
+  }
+  return qh;
+}
+
+// Computes the reciprocal of d, which has length n and its top bit
+// set, into dest, which has length n+1. The result X satisfies
+// d*X < B^(2n) <= d*(X+2), so it is floor(B^(2n) / d) or just under.
+// Short divisors are divided out exactly; longer ones use Newton's
+// iteration from the reciprocal of the top half of d, as in
+// Brent and Zimmermann's ApproximateReciprocal.
+void PosInt::reciprocalArray (Digit* dest, const Digit* d, int n) {
+  if (n < divThresholds.newton) {
+    vector<Digit> num (2*n, ~(Digit)0);
+    vector<Digit> scratch (bzScratch(n, n));
+    STATS_SCRATCH(scratch.size());
+    dest[n] = bzDivremArray(dest, &num[0], d, n, n, scratch.data());
+    return;
+  }
+
+  int l = (n-1)/2;
+  int h = n - l;
+  vector<Digit> xh (h+1);
+  vector<Digit> t (n+h+1);
+  vector<Digit> u (2*h+2);
+  vector<Digit> scratch 
+    (max(unbalancedMulScratch(n, h+1), unbalancedMulScratch(h+1, h+1)));
+  STATS_SCRATCH(scratch.size());
+  reciprocalArray(&xh[0], d + l, h);
+
+  // t = d*xh, brought under B^(n+h), then t = B^(n+h) - t
+  unbalancedMulArray(&t[0], d, n, &xh[0], h+1, scratch.data());
+  while (t[n+h] != 0) {
+    subWrap(&xh[0], &oneDigit, 1, h+1);
+    subWrap(&t[0], d, n, n+h+1);
+  }
+  negWrap(&t[0], n+h);
+
+  // t is now less than 2d, so only h+1 digits remain above B^l
+  unbalancedMulArray(&u[0], &t[l], h+1, &xh[0], h+1, scratch.data());
+  for (int i=0; i<=n; ++i) dest[i] = 0;
+  for (int i=0; i<=h; ++i) dest[l+i] = xh[i];
+  addWrap(dest, &u[2*h - l], l+2, n+1);
+}
+
+// Divides the 2n digits at np by d, which has length n and its top
+// bit set, using the reciprocal inv from reciprocalArray. The top n
+// digits of np must be less than d. The n-digit quotient goes in q
+// and the remainder is left in np[0..n), with zeros above it.
+// scratch must have size 4n + unbalancedMulScratch(n, n).
+void PosInt::newtonDivremArray (Digit* q, Digit* np, 
+  const Digit* d, int n, const Digit* inv, Digit* scratch)
+{
+  STATS_KERNEL(STATS_NEWTON_DIVREM_ARRAY, 2*n);
+  Digit* prod = scratch;
+  Digit* mscratch = prod + 4*n;
+
+  // q = floor(top * inv / B^n), where inv = B^n + inv[0..n).
+  // This is at most a few less than the true quotient.
+  unbalancedMulArray(prod, np + n, n, inv, n, mscratch);
+  for (int i=0; i<n; ++i) q[i] = np[n+i];
+  addWrap(q, prod + n, n, n);
+
+  // np -= q*d, then correct upwards
+  Digit* qd = prod + 2*n;
+  unbalancedMulArray(qd, q, n, d, n, mscratch);
+  subWrap(np, qd, 2*n, 2*n);
+  while (compareDigits(np, n+1, d, n) >= 0) {
+    np[n] -= subWrap(np, d, n, n);
+    addWrap(q, &oneDigit, 1, n);
+  }
+}
+
+// Computes division with remainder, digit-wise, with the same
+// requirements as divremArray. Short divisors or quotients go straight
+// to divremArray. Otherwise x is divided from the top down in blocks
+// of ylen quotient digits, each by the Burnikel-Ziegler recursion, or
+// with a reciprocal computed once by Newton's method for long divisors.
+void PosInt::fastDivremArray 
+  (Digit* q, Digit* r, const Digit* x, int xlen, const Digit* y, int ylen)
+{
+  int n = ylen;
+  int qn = xlen - ylen;
+  if (n < divThresholds.burnikelZiegler || qn < divThresholds.burnikelZiegler) {
+    vector<Digit> scratch (ylen+1);
+    STATS_SCRATCH(scratch.size());
+    divremArray(q, r, x, xlen, y, ylen, scratch.data());
+    return;
+  }
 
-  delete [] temp;
+  // r holds what is left to divide. Take the top digit of the
+  // quotient first, so that every block after it has its top n
+  // digits less than y.
+  for (int i=0; i<xlen; ++i) r[i] = x[i];
+  q[qn] = 0;
+  if (compareDigits(r + qn, n, y, n) >= 0) {
+    subWrap(r + qn, y, n, n);
+    q[qn] = 1;
+  }
+
+  bool newton = (n >= divThresholds.newton && qn >= n);
+  int first = qn % n;
+  vector<Digit> inv (newton ? n+1 : 0);
+  if (newton) reciprocalArray(&inv[0], y, n);
+  vector<Digit> scratch (max(first ? bzScratch(n, first) : 0,
+    newton ? 4*n + unbalancedMulScratch(n, n) : bzScratch(n, n)));
+  STATS_SCRATCH(scratch.size());
+
+  int pos = qn - first;
+  if (first) bzDivremArray(q + pos, r + pos, y, n, first, scratch.data());
+  while (pos > 0) {
+    pos -= n;
+    if (newton) newtonDivremArray(q + pos, r + pos, y, n, &inv[0], scratch.data());
+    else bzDivremArray(q + pos, r + pos, y, n, n, scratch.data());
+  }
+  for (int i=n; i<xlen; ++i) r[i] = 0;
 }
 
 // Computes division with remainder. After the call, we have
 // x = q*y + r, and 0 <= r < y.
 void PosInt::divrem (PosInt& q, PosInt& r, const PosInt& x, const PosInt& y) {
+  STATS_OP(STATS_DIVREM);
   if (y.digits.empty()) throw MPError("Divide by zero");
   else if (&q == &r) throw MPError("Quotient and remainder can't be the same");
   else if (x.compare(y) < 0) {
@@ -637,106 +2220,1315 @@ void PosInt::divrem (PosInt& q, PosInt& r, const PosInt& x, const PosInt& y) {
     return;
   }
   else if (y.digits.size() == 1) {
-    int divdig = y.digits[0];
+    Digit divdig = y.digits[0];
     q.set(x);
-    r.set (divDigit (&q.digits[0], divdig, q.digits.size()));
+    Digit rdig = divDigit (&q.digits[0], divdig, q.digits.size());
+    r.digits.assign (1, rdig);
   }
-  else if (2*y.digits.back() < B) {
+  else if ((y.digits.back() >> 63) == 0) {
+    // Scale so the top bit of the divisor is set
     int ylen = y.digits.size();
-    int fac = 1;
-    int* scaley = new int[ylen];
-    for (int i=0; i<ylen; ++i) scaley[i] = y.digits[i];
-    do {
-      mulDigit (scaley, 2, ylen);
-      fac *= 2;
-    } while (2*scaley[ylen-1] < B);
+    Digit fac = (Digit)1 << __builtin_clzll(y.digits.back());
+    vector<Digit> scaley (y.digits.begin(), y.digits.end());
+    mulDigit (&scaley[0], fac, ylen);
 
     int xlen = x.digits.size()+1;
-    int* scalex = new int[xlen];
-    for (int i=0; i<xlen-1; ++i) scalex[i] = x.digits[i];
-    scalex[xlen-1] = 0;
-    mulDigit (scalex, fac, xlen);
+    vector<Digit> scalex (x.digits.begin(), x.digits.end());
+    scalex.push_back(0);
+    mulDigit (&scalex[0], fac, xlen);
     q.digits.resize(xlen - ylen + 1);
     r.digits.resize(xlen);
-    divremArray (&q.digits[0], &r.digits[0], scalex, xlen, scaley, ylen);
+    fastDivremArray (&q.digits[0], &r.digits[0], &scalex[0], xlen, &scaley[0], ylen);
     divDigit (&r.digits[0], fac, xlen);
-    delete [] scaley;
-    delete [] scalex;
   }
   else {
     int xlen = x.digits.size();
     int ylen = y.digits.size();
-    int* xarr = NULL;
-    int* yarr = NULL;
+    // Copy whichever operands are also outputs
+    vector<Digit> xcopy, ycopy;
+    const Digit* xarr = &x.digits[0];
+    const Digit* yarr = &y.digits[0];
     if (&x == &q || &x == &r) {
-      xarr = new int[xlen];
-      for (int i=0; i<xlen; ++i) xarr[i] = x.digits[i];
+      xcopy.assign(x.digits.begin(), x.digits.end());
+      xarr = &xcopy[0];
     }
     if (&y == &q || &y == &r) {
-      yarr = new int[ylen];
-      for (int i=0; i<ylen; ++i) yarr[i] = y.digits[i];
+      ycopy.assign(y.digits.begin(), y.digits.end());
+      yarr = &ycopy[0];
     }
     q.digits.resize(xlen - ylen + 1);
     r.digits.resize(xlen);
-    divremArray (&q.digits[0], &r.digits[0], 
-      (xarr == NULL ? (&x.digits[0]) : xarr), xlen, 
-      (yarr == NULL ? (&y.digits[0]) : yarr), ylen);
-    if (xarr != NULL) delete [] xarr;
-    if (yarr != NULL) delete [] yarr;
+    fastDivremArray (&q.digits[0], &r.digits[0], xarr, xlen, yarr, ylen);
   }
   q.normalize();
   r.normalize();
 }
 
+/******************** MODULAR REDUCTION ********************/
+
+ModContext::ModContext (const PosInt& modulus) :n(modulus) {
+  if (n.isZero()) throw MPError("Divide by zero");
+  k = n.digits.size();
+
+  // mu = floor((B^(2k) - 1) / n), which always fits in k+1 digits
+  PosInt top, quo, rem;
+  top.digits.assign(2*k, ~(PosInt::Digit)0);
+  PosInt::divrem(quo, rem, top, n);
+  mu.assign(quo.digits.begin(), quo.digits.end());
+  mu.resize(k+1, 0);
+
+  npad.assign(n.digits.begin(), n.digits.end());
+  npad.push_back(0);
+  abuf.resize(k);
+  bbuf.resize(k);
+  xbuf.resize(2*k);
+  q2.resize(2*k+2);
+  prod.resize(2*k+2);
+  r.resize(k+2);
+  scratch.resize(max(PosInt::balancedMulScratch(k), PosInt::balancedMulScratch(k+1)));
+  STATS_SCRATCH(scratch.size());
+}
+
+// Sets r to x mod n, for x with length at most 2k held in xbuf.
+// With q = floor(x / n), the estimate q3 below is at most 3 short
+// of q, so r = x - q3*n is less than 4n and fits in k+1 digits.
+void ModContext::reduceBuffer () {
+  typedef PosInt::Digit Digit;
+
+  // q3 = floor(floor(x / B^(k-1)) * mu / B^(k+1))
+  PosInt::balancedMulArray(&q2[0], &xbuf[k-1], &mu[0], k+1, scratch.data());
+  const Digit* q3 = &q2[k+1];
+
+  // r = (x - q3*n) mod B^(k+1)
+  PosInt::balancedMulArray(&prod[0], q3, &npad[0], k+1, scratch.data());
+  for (int i=0; i<=k; ++i) r[i] = xbuf[i];
+  r[k+1] = 1;
+  PosInt::subArray(&r[0], &prod[0], k+1);
+
+  while (PosInt::compareDigits(&r[0], k+1, &n.digits[0], k) >= 0)
+    PosInt::subArray(&r[0], &n.digits[0], k);
+}
+
+// x = x mod n
+void ModContext::reduce (PosInt& x) {
+  // Reduce the top 2k digits at a time, which takes off k digits
+  // each time, until what is left is below n.
+  while (x.compare(n) >= 0) {
+    int len = x.digits.size();
+    int start = len > 2*k ? len - 2*k : 0;
+    for (int i=0; i<2*k; ++i) 
+      xbuf[i] = start + i < len ? x.digits[start + i] : 0;
+    reduceBuffer();
+    x.digits.resize(start + k);
+    for (int i=0; i<k; ++i) x.digits[start + i] = r[i];
+    x.normalize();
+  }
+}
+
+// result = a * b mod n, where a and b are less than n
+void ModContext::mulmod (PosInt& result, const PosInt& a, const PosInt& b) {
+  if (a.digits.size() > k || b.digits.size() > k) {
+    PosInt prodcopy(a);
+    prodcopy.mul(b);
+    reduce(prodcopy);
+    result.set(prodcopy);
+    return;
+  }
+  for (int i=0; i<k; ++i) {
+    abuf[i] = i < a.digits.size() ? a.digits[i] : 0;
+    bbuf[i] = i < b.digits.size() ? b.digits[i] : 0;
+  }
+  PosInt::balancedMulArray(&xbuf[0], &abuf[0], &bbuf[0], k, scratch.data());
+  reduceBuffer();
+  result.digits.assign(r.begin(), r.begin() + k);
+  result.normalize();
+}
+
+// result = a^2 mod n, where a is less than n
+void ModContext::sqrmod (PosInt& result, const PosInt& a) {
+  if (a.digits.size() > k) {
+    mulmod(result, a, a);
+    return;
+  }
+  for (int i=0; i<k; ++i)
+    abuf[i] = i < a.digits.size() ? a.digits[i] : 0;
+  PosInt::balancedSqrArray(&xbuf[0], &abuf[0], k, scratch.data());
+  reduceBuffer();
+  result.digits.assign(r.begin(), r.begin() + k);
+  result.normalize();
+}
+
 /******************** EXPONENTIATION ********************/
 
+// Returns the number of bits in the window for sliding-window
+// exponentiation with an exponent of the given bit length
+static int windowSize (int bits) {
+  if (bits < 8) return 1;
+  else if (bits < 24) return 2;
+  else if (bits < 80) return 3;
+  else if (bits < 240) return 4;
+  else if (bits < 672) return 5;
+  else if (bits < 1792) return 6;
+  else return 7;
+}
+
+// Returns d^e, which must fit in a single digit
+static PosInt::Digit powDigit (PosInt::Digit d, int e) {
+  PosInt::Digit result = 1;
+  for (; e; e >>= 1, d *= d)
+    if (e & 1) result *= d;
+  return result;
+}
+
 // this = this ^ x
+// A factor of 2^t in this is taken out first and put back at the end
+// as a shift by t*x bits, so powers of two (and of the radix) cost
+// nothing more. The odd part m is then raised by left-to-right
+// square-and-multiply, with sqr and mul picking the kernel for each
+// step from the current length:
+//   - a one-digit m uses fixed windows of k bits, with k as large as
+//     keeps m^(2^k - 1) in one digit, so each window costs one mulDigit;
+//   - a longer m uses sliding windows over a table of its odd powers,
+//     as powmod does.
 void PosInt::pow (const PosInt& x) {
-  static const PosInt one(1);
-
+  STATS_OP(STATS_POW);
   if (this == &x) {
     PosInt xcopy(x);
     pow(xcopy);
     return;
   }
 
-  PosInt mycopy(*this);
-  set(1);
-  for (PosInt i(0); i.compare(x) < 0; i.add(one)) {
-    mul(mycopy);
+  if (x.isZero()) {
+    set(1);
+    return;
+  }
+  else if (isZero() || isOne()) return;
+  else if (x.digits.size() > 1 || (DDigit)x.digits[0] * bitLength() > INT_MAX)
+    throw MPError("Result of pow is too large");
+  int e = x.digits[0];
+  int ebits = x.bitLength();
+
+  int t = 0;
+  while (!testBit(t)) ++t;
+  PosInt m(*this);
+  m.shiftRight(t);
+
+  if (m.isOne()) set(1);
+  else if (m.digits.size() == 1) {
+    Digit md = m.digits[0];
+    int mbits = m.bitLength();
+    int k = 1;
+    while (((2 << k) - 1) * mbits <= 64) ++k;
+    int top = (ebits - 1) % k + 1;
+    set(1);
+    digits[0] = powDigit(md, e >> (ebits - top));
+    for (int i = ebits - top - k; i >= 0; i -= k) {
+      for (int j=0; j<k; ++j) sqr();
+      int window = (e >> i) & ((1 << k) - 1);
+      if (window) {
+        digits.push_back(0);
+        mulDigit(&digits[0], powDigit(md, window), digits.size()-1);
+        normalize();
+      }
+    }
+  }
+  else {
+    int k = windowSize(ebits);
+    int tsize = 1 << (k-1);
+    vector<PosInt> table (tsize, m);
+    PosInt msq(m);
+    msq.sqr();
+    for (int j=1; j<tsize; ++j) {
+      table[j].set(table[j-1]);
+      table[j].mul(msq);
+    }
+
+    // Scan the exponent from the top, as in powmod
+    bool started = false;
+    for (int i = ebits-1; i >= 0; ) {
+      if (!((e >> i) & 1)) {
+        sqr();
+        --i;
+        continue;
+      }
+      int j = max(i-k+1, 0);
+      while (!((e >> j) & 1)) ++j;
+      int window = (e >> j) & ((1 << (i-j+1)) - 1);
+
+      if (started) {
+        for (int bit = i; bit >= j; --bit) sqr();
+        mul(table[window/2]);
+      }
+      else {
+        set(table[window/2]);
+        started = true;
+      }
+      i = j-1;
+    }
+  }
+
+  shiftLeft(t * e);
+}
+
+// Computes dest = x * y / B^len mod n, digit-wise (Montgomery
+// multiplication). x and y are less than n, which is odd and has
+// length len, and ninv = -n^(-1) mod B.
+// prod must have size (2*len+1), and scratch balancedMulScratch(len).
+// If x and y are the same array, the product is computed as a square.
+void PosInt::montMulArray (Digit* dest, const Digit* x, const Digit* y, 
+  const Digit* n, int len, Digit ninv, Digit* prod, Digit* scratch)
+{
+  STATS_KERNEL(STATS_MONT_MUL_ARRAY, len);
+  if (x == y) {
+    if (len < mulThresholds.karatsuba) sqrArray(prod, x, len);
+    else balancedSqrArray(prod, x, len, scratch);
+  }
+  else {
+    if (len < mulThresholds.karatsuba) mulArray(prod, x, len, y, len);
+    else balancedMulArray(prod, x, y, len, scratch);
+  }
+  prod[2*len] = 0;
+
+  // Add multiples of n to clear the low digits one at a time
+  for (int i=0; i<len; ++i)
+    addMulWrap(prod + i, n, len, prod[i] * ninv, 2*len + 1 - i);
+
+  Digit* high = prod + len;
+  if (high[len] || compareDigits(high, len, n, len) >= 0)
+    subArray(high, n, len);
+  for (int i=0; i<len; ++i) dest[i] = high[i];
+}
+
+MontContext::MontContext (const PosInt& modulus) :n(modulus) {
+  if (n.isEven()) throw MPError("Montgomery modulus must be odd");
+  k = n.digits.size();
+  ninv = -inverseDigit(n.digits[0]);
+
+  // r1 = B^k mod n and r2 = B^(2k) mod n, the Montgomery forms of 1 and B^k
+  r2.digits.assign(2*k, 0);
+  r2.digits.push_back(1);
+  r2.mod(n);
+  r1.digits.assign(k, 0);
+  r1.digits.push_back(1);
+  r1.mod(n);
+
+  abuf.resize(k);
+  bbuf.resize(k);
+  prod.resize(2*k + 1);
+  scratch.resize(PosInt::balancedMulScratch(k));
+  STATS_SCRATCH(scratch.size());
+}
+
+// Copies x into buf, padded with zeros to k digits
+void MontContext::load (vector<PosInt::Digit>& buf, const PosInt& x) {
+  for (int i=0; i<k; ++i)
+    buf[i] = i < x.digits.size() ? x.digits[i] : 0;
+}
+
+// Sets result to the Montgomery product of abuf and bbuf, or of abuf
+// with itself
+void MontContext::mulBuffers (PosInt& result, bool square) {
+  const PosInt::Digit* y = square ? &abuf[0] : &bbuf[0];
+  PosInt::montMulArray(&abuf[0], &abuf[0], y, &n.digits[0], k, ninv, 
+                       &prod[0], scratch.data());
+  result.digits.assign(abuf.begin(), abuf.end());
+  result.normalize();
+}
+
+// x = x * B^k mod n, as the Montgomery product of x and B^(2k)
+void MontContext::toMont (PosInt& x) {
+  load(abuf, x);
+  load(bbuf, r2);
+  mulBuffers(x, false);
+}
+
+// x = x / B^k mod n, as the Montgomery product of x and 1
+void MontContext::fromMont (PosInt& x) {
+  load(abuf, x);
+  load(bbuf, PosInt(1));
+  mulBuffers(x, false);
+}
+
+// result = a * b / B^k mod n
+void MontContext::mulmod (PosInt& result, const PosInt& a, const PosInt& b) {
+  load(abuf, a);
+  load(bbuf, b);
+  mulBuffers(result, false);
+}
+
+// result = a * a / B^k mod n
+void MontContext::sqrmod (PosInt& result, const PosInt& a) {
+  load(abuf, a);
+  mulBuffers(result, true);
+}
+
+// result = a^e, by sliding windows over a table of the odd powers of a
+void MontContext::powmod (PosInt& result, const PosInt& a, const PosInt& e) {
+  typedef PosInt::Digit Digit;
+  int bits = e.bitLength();
+  if (bits == 0) {
+    result.set(r1);
+    return;
+  }
+
+  const Digit* n0 = &n.digits[0];
+  int w = windowSize(bits);
+  int tsize = 1 << (w-1);
+
+  // Arena: the table of odd powers, the accumulator and a^2
+  vector<Digit> arena ((tsize + 2)*k);
+  Digit* table = &arena[0];
+  Digit* acc = table + tsize*k;
+  Digit* asq = acc + k;
+  Digit* pr = &prod[0];
+  Digit* sc = scratch.data();
+
+  // table[j] = a^(2j+1)
+  for (int i=0; i < a.digits.size(); ++i) table[i] = a.digits[i];
+  if (tsize > 1) {
+    PosInt::montMulArray(asq, table, table, n0, k, ninv, pr, sc);
+    for (int j=1; j<tsize; ++j)
+      PosInt::montMulArray(table + j*k, table + (j-1)*k, asq, n0, k, ninv, pr, sc);
+  }
+
+  // Scan the exponent from the top. Each window starts and ends
+  // with a 1 bit, so its value is odd and is in the table.
+  bool started = false;
+  for (int i = bits-1; i >= 0; ) {
+    if (!e.testBit(i)) {
+      PosInt::montMulArray(acc, acc, acc, n0, k, ninv, pr, sc);
+      --i;
+      continue;
+    }
+    int j = max(i-w+1, 0);
+    while (!e.testBit(j)) ++j;
+    int window = 0;
+    for (int bit = i; bit >= j; --bit)
+      window = 2*window + e.testBit(bit);
+
+    if (started) {
+      for (int bit = i; bit >= j; --bit)
+        PosInt::montMulArray(acc, acc, acc, n0, k, ninv, pr, sc);
+      PosInt::montMulArray(acc, acc, table + (window/2)*k, n0, k, ninv, pr, sc);
+    }
+    else {
+      for (int d=0; d<k; ++d) acc[d] = table[(window/2)*k + d];
+      started = true;
+    }
+    i = j-1;
   }
+
+  result.digits.assign(acc, acc + k);
+  result.normalize();
 }
 
 // result = a^b mod n
-void powmod (PosInt& result, const PosInt& a, const PosInt& b, const PosInt& n) {
+// For odd n this works in Montgomery form, with a sliding window over
+// the bits of b and a table of the odd powers of a. Even n falls back
+// to plain square-and-multiply with Barrett reduction.
+void PosInt::powmod 
+  (PosInt& result, const PosInt& a, const PosInt& b, const PosInt& n)
+{
+  STATS_OP(STATS_POWMOD);
+  if (n.isZero()) throw MPError("Divide by zero");
+
+  PosInt base(a);
+  base.mod(n);
+  PosInt e(b);
+  PosInt mod(n);
+  int bits = e.bitLength();
+
+  if (mod.isOne()) {
+    result.set(0);
+    return;
+  }
+  else if (bits == 0) {
+    result.set(1);
+    return;
+  }
+  else if (mod.isEven()) {
+    ModContext ctx(mod);
+    PosInt acc(base);
+    for (int i = bits-2; i >= 0; --i) {
+      ctx.sqrmod(acc, acc);
+      if (e.testBit(i)) ctx.mulmod(acc, acc, base);
+    }
+    result.set(acc);
+    return;
+  }
+
+  MontContext ctx(mod);
+  ctx.toMont(base);
+  ctx.powmod(result, base, e);
+  ctx.fromMont(result);
+}
+
+// result[i] = a[i]^e[i] mod n for each i, or a[i]^e[0] mod n if e has
+// a single entry, spread over the thread pool. For odd n, each worker
+// keeps its own copy of one MontContext, so the modulus is prepared
+// once and the buffers are reused for every job the worker does.
+void PosInt::powmodBatch (vector<PosInt>& result, 
+  const vector<PosInt>& a, const vector<PosInt>& e, const PosInt& n)
+{
+  STATS_OP(STATS_POWMOD_BATCH);
+  if (n.isZero()) throw MPError("Divide by zero");
+  else if (e.size() != 1 && e.size() != a.size())
+    throw MPError("Batch operands must have the same length");
+  int k = a.size();
+  bool shared = (e.size() == 1);
+  if (shared && k > 1 && &result == &e) {
+    vector<PosInt> exp (e);
+    powmodBatch(result, a, exp, n);
+    return;
+  }
+  result.resize(k);
+
+  if (n.isEven() || n.isOne()) {
+    runBatch(k, [&] (int i) {
+      powmod(result[i], a[i], e[shared ? 0 : i], n);
+    });
+    return;
+  }
 
+  MontContext proto(n);
+  runBatch(k, [&, ctx = proto] (int i) mutable {
+    PosInt base(a[i]);
+    if (base.compare(n) >= 0) base.mod(n);
+    ctx.toMont(base);
+    ctx.powmod(result[i], base, e[shared ? 0 : i]);
+    ctx.fromMont(result[i]);
+  });
 }
 
 /******************** GCDs ********************/
 
+// Operand length at which gcd moves on to the half-GCD.
+// The default is measured by "make tune".
+static PosInt::GcdThresholds gcdThresholds = { HGCD_THRESHOLD };
+
+PosInt::GcdThresholds PosInt::getGcdThresholds () {
+  return gcdThresholds;
+}
+
+void PosInt::setGcdThresholds (const GcdThresholds& t) {
+  if (t.hgcd < 4)
+    throw MPError("GCD threshold is too small");
+  gcdThresholds = t;
+}
+
+// The matrix of a reduction. The GCD routines keep (a;b) = M (c;d)
+// for the original numbers a and b and the reduced ones c and d.
+// The entries are non-negative and the determinant det is 1 or -1.
+struct PosInt::GcdMatrix {
+  PosInt m11, m12, m21, m22;
+  int det;
+
+  GcdMatrix () :m11(1), m22(1), det(1) { }
+
+  bool isIdentity () const { return m12.isZero() && m21.isZero(); }
+
+  // M = M * (0 1; 1 0), for when c and d trade places
+  void swapColumns () {
+    m11.digits.swap(m12.digits);
+    m21.digits.swap(m22.digits);
+    det = -det;
+  }
+};
+
+// Binary GCD of two digits
+static PosInt::Digit gcdDigit (PosInt::Digit a, PosInt::Digit b) {
+  if (a == 0) return b;
+  else if (b == 0) return a;
+  int shift = __builtin_ctzll(a | b);
+  a >>= __builtin_ctzll(a);
+  while (b != 0) {
+    b >>= __builtin_ctzll(b);
+    if (a > b) swap(a, b);
+    b -= a;
+  }
+  return a << shift;
+}
+
+// Returns the number of trailing zero bits in a non-zero x
+static int ctzDDigit (PosInt::DDigit x) {
+  PosInt::Digit low = (PosInt::Digit)x;
+  return low ? __builtin_ctzll(low) : 64 + __builtin_ctzll((PosInt::Digit)(x >> 64));
+}
+
+// Binary GCD of two double digits
+static PosInt::DDigit gcdDDigit (PosInt::DDigit a, PosInt::DDigit b) {
+  if (a == 0) return b;
+  else if (b == 0) return a;
+  int shift = ctzDDigit(a | b);
+  a >>= ctzDDigit(a);
+  while (b != 0 && (a >> 64 || b >> 64)) {
+    b >>= ctzDDigit(b);
+    if (a > b) swap(a, b);
+    b -= a;
+  }
+  if (b != 0) a = gcdDigit((PosInt::Digit)a, (PosInt::Digit)b);
+  return a << shift;
+}
+
+// Returns floor(x / 2^shift) mod B
+static PosInt::Digit topBits (const PosInt::Digit* x, int len, int shift) {
+  int d = shift / 64;
+  int b = shift % 64;
+  if (d >= len) return 0;
+  PosInt::Digit bits = x[d] >> b;
+  if (b && d+1 < len) bits |= x[d+1] << (64-b);
+  return bits;
+}
+
+// dest = u*x + v*y, or u*x - v*y if subtract is set
+void PosInt::linComb (PosInt& dest, 
+  const PosInt& x, Digit u, const PosInt& y, Digit v, bool subtract)
+{
+  int xlen = x.digits.size();
+  int ylen = y.digits.size();
+  int len = max(xlen, ylen) + 2;
+  dest.digits.assign(len, 0);
+  if (xlen) addMulWrap(&dest.digits[0], &x.digits[0], xlen, u, len);
+  if (ylen && subtract) subMulWrap(&dest.digits[0], &y.digits[0], ylen, v, len);
+  else if (ylen) addMulWrap(&dest.digits[0], &y.digits[0], ylen, v, len);
+  dest.normalize();
+}
+
+// dest = x1*y1 + x2*y2
+static void dotProduct (PosInt& dest, const PosInt& x1, const PosInt& y1,
+  const PosInt& x2, const PosInt& y2) 
+{
+  PosInt second(x2);
+  second.mul(y2);
+  dest.set(x1);
+  dest.mul(y1);
+  dest.add(second);
+}
+
+// Does one step of Lehmer's method on a >= b > 0, and updates M
+// unless it is NULL. temp must have room for two PosInts.
+//
+// Euclid's algorithm is run on the top 62 bits of a and the same bits
+// of b, with single-digit cofactors (A B; C D). The simulated
+// remainders differ from the true ones (over 2^shift) by less than the
+// largest cofactor, so each step is taken only while that still leaves
+// the true remainder at least B^s. If not even one step passes, a full
+// division step is done instead, unless its remainder is below B^s.
+bool PosInt::gcdStep (PosInt& a, PosInt& b, int s, GcdMatrix* M, PosInt* temp) {
+  int shift = max(0, a.bitLength() - 62);
+  Digit x = topBits(&a.digits[0], a.digits.size(), shift);
+  Digit y = topBits(&b.digits[0], b.digits.size(), shift);
+  Digit low = 1;
+  if (64*s > shift) low = (Digit)1 << min(64*s - shift, 62);
+
+  int64_t A = 1, B = 0, C = 0, D = 1;
+  int steps = 0;
+  while (y != 0) {
+    Digit q = x / y;
+    Digit r = x - q*y;
+    int64_t nextC = A - (int64_t)q*C;
+    int64_t nextD = B - (int64_t)q*D;
+    Digit err = max(llabs(nextC), llabs(nextD));
+    if (r < low + err) break;
+    A = C;
+    B = D;
+    C = nextC;
+    D = nextD;
+    x = y;
+    y = r;
+    ++steps;
+  }
+
+  if (steps > 0) {
+    // a = A*a + B*b and b = C*a + D*b, where A and B have opposite
+    // signs, as do C and D
+    if (B <= 0) linComb(temp[0], a, A, b, -B, true);
+    else linComb(temp[0], b, B, a, -A, true);
+    if (D <= 0) linComb(temp[1], a, C, b, -D, true);
+    else linComb(temp[1], b, D, a, -C, true);
+    a.digits.swap(temp[0].digits);
+    b.digits.swap(temp[1].digits);
+
+    // M = M * (A B; C D)^(-1), which is (|D| |B|; |C| |A|)
+    if (M) {
+      linComb(temp[0], M->m11, llabs(D), M->m12, llabs(C), false);
+      linComb(temp[1], M->m11, llabs(B), M->m12, llabs(A), false);
+      M->m11.digits.swap(temp[0].digits);
+      M->m12.digits.swap(temp[1].digits);
+      linComb(temp[0], M->m21, llabs(D), M->m22, llabs(C), false);
+      linComb(temp[1], M->m21, llabs(B), M->m22, llabs(A), false);
+      M->m21.digits.swap(temp[0].digits);
+      M->m22.digits.swap(temp[1].digits);
+      if (steps % 2) M->det = -M->det;
+    }
+  }
+  else {
+    // a, b = b, a mod b, and M = M * (q 1; 1 0)
+    PosInt& q = temp[0];
+    divrem(q, temp[1], a, b);
+    if (temp[1].digits.size() <= s) return false;
+    a.digits.swap(b.digits);
+    b.digits.swap(temp[1].digits);
+    if (M) {
+      dotProduct(temp[1], M->m11, q, M->m12, PosInt(1));
+      M->m12.digits.swap(M->m11.digits);
+      M->m11.digits.swap(temp[1].digits);
+      dotProduct(temp[1], M->m21, q, M->m22, PosInt(1));
+      M->m22.digits.swap(M->m21.digits);
+      M->m21.digits.swap(temp[1].digits);
+      M->det = -M->det;
+    }
+  }
+
+  if (a.compare(b) < 0) {
+    a.digits.swap(b.digits);
+    if (M) M->swapColumns();
+  }
+  return true;
+}
+
+// Reduces a and b, which are at least B^s, by steps that keep them
+// at least B^s, until no more are possible, and sets M to the matrix
+// of the reduction. Small operands just use gcdStep. Larger ones are
+// first reduced by two half-size recursive calls on their top digits,
+// the first taking them to about 3/4 of their length and the second
+// down to about s digits, as in Moller's version of Schonhage's
+// algorithm; gcdStep then finishes off.
+void PosInt::hgcd (PosInt& a, PosInt& b, int s, GcdMatrix& M) {
+  M = GcdMatrix();
+  if (a.compare(b) < 0) {
+    a.digits.swap(b.digits);
+    M.swapColumns();
+  }
+  if (b.digits.size() <= s) return;
+
+  PosInt temp[2];
+  int n = a.digits.size();
+  if (n >= gcdThresholds.hgcd) {
+    hgcdTop(a, b, n/2, s, &M);
+    while (a.digits.size() > 3*n/4 + 1)
+      if (!gcdStep(a, b, s, &M, temp)) return;
+    hgcdTop(a, b, 2*s - (int)a.digits.size() + 1, s, &M);
+  }
+  while (gcdStep(a, b, s, &M, temp));
+}
+
+// Runs hgcd on a and b without their low p digits, then applies the
+// reduction to all of a and b, and to M unless it is NULL.
+//
+// If the top parts reduce to c1 and d1 with a matrix M1, the whole
+// numbers reduce to c = c1*B^p + det*(m22*a0 - m12*b0) and
+// d = d1*B^p + det*(m11*b0 - m21*a0), where a0 and b0 are the low
+// p digits. The entries of M1 are less than B^(n1-s1) <= c1/B, so c and
+// d stay above B^(s1+p-1); the call is skipped unless that is at
+// least B^s.
+void PosInt::hgcdTop (PosInt& a, PosInt& b, int p, int s, GcdMatrix* M) {
+  int n = a.digits.size();
+  if (p <= 0 || p >= n) return;
+  int n1 = n - p;
+  int s1 = n1/2 + 1;
+  if (s1 + p - 1 < s || b.digits.size() <= p + s1) return;
+
+  PosInt c, d;
+  c.digits.assign(a.digits.begin() + p, a.digits.end());
+  d.digits.assign(b.digits.begin() + p, b.digits.end());
+  GcdMatrix M1;
+  hgcd(c, d, s1, M1);
+  if (M1.isIdentity()) return;
+
+  PosInt a0, b0, plus, minus;
+  a0.digits.assign(a.digits.begin(), a.digits.begin() + p);
+  a0.normalize();
+  b0.digits.assign(b.digits.begin(), b.digits.begin() + p);
+  b0.normalize();
+
+  plus.set(M1.det > 0 ? M1.m22 : M1.m12);
+  plus.mul(M1.det > 0 ? a0 : b0);
+  minus.set(M1.det > 0 ? M1.m12 : M1.m22);
+  minus.mul(M1.det > 0 ? b0 : a0);
+  c.shiftLeft(64*p);
+  c.add(plus);
+  c.sub(minus);
+
+  plus.set(M1.det > 0 ? M1.m11 : M1.m21);
+  plus.mul(M1.det > 0 ? b0 : a0);
+  minus.set(M1.det > 0 ? M1.m21 : M1.m11);
+  minus.mul(M1.det > 0 ? a0 : b0);
+  d.shiftLeft(64*p);
+  d.add(plus);
+  d.sub(minus);
+
+  a.digits.swap(c.digits);
+  b.digits.swap(d.digits);
+
+  // M = M * M1
+  if (M) {
+    GcdMatrix prod;
+    dotProduct(prod.m11, M->m11, M1.m11, M->m12, M1.m21);
+    dotProduct(prod.m12, M->m11, M1.m12, M->m12, M1.m22);
+    dotProduct(prod.m21, M->m21, M1.m11, M->m22, M1.m21);
+    dotProduct(prod.m22, M->m21, M1.m12, M->m22, M1.m22);
+    prod.det = M->det * M1.det;
+    *M = prod;
+  }
+
+  if (a.compare(b) < 0) {
+    a.digits.swap(b.digits);
+    if (M) M->swapColumns();
+  }
+}
+
 // this = gcd(x,y)
+// Large operands are cut down with the half-GCD of their top two
+// thirds, medium ones with Lehmer steps, and the last two digits
+// are finished with a binary GCD.
 void PosInt::gcd (const PosInt& x, const PosInt& y) {
-  PosInt b(y);
-  set(x);
-  while (!b.isZero()) {
-    PosInt r (*this);
-    r.mod(b);
-    set(b);
-    b.set(r);
+  STATS_OP(STATS_GCD);
+  PosInt a(x), b(y);
+  if (a.compare(b) < 0) a.digits.swap(b.digits);
+
+  PosInt temp[2];
+  bool divides = false;
+  while (!divides && b.digits.size() >= gcdThresholds.hgcd) {
+    hgcdTop(a, b, a.digits.size()/3, 0, NULL);
+    divides = !gcdStep(a, b, 0, NULL, temp);
+  }
+  while (!divides && b.digits.size() > 2)
+    divides = !gcdStep(a, b, 0, NULL, temp);
+
+  if (divides || b.isZero()) {
+    set(divides ? b : a);
+    return;
   }
+  else if (a.digits.size() > 2) {
+    a.mod(b);
+    a.digits.swap(b.digits);
+  }
+
+  DDigit av = 0, bv = 0;
+  for (int i = a.digits.size()-1; i >= 0; --i) av = (av << 64) | a.digits[i];
+  for (int i = b.digits.size()-1; i >= 0; --i) bv = (bv << 64) | b.digits[i];
+  DDigit g = gcdDDigit(av, bv);
+  digits.assign(1, (Digit)g);
+  digits.push_back((Digit)(g >> 64));
+  normalize();
 }
 
 // this = gcd(x,y) = s*x - t*y
 // NOTE THE MINUS SIGN! This is required so that both s and t are
 // always non-negative.
+// The reduction is the same as in gcd, but keeps the matrix M with
+// (x;y) = M (a;b). When it stops, b divides a (or b is 0), so the gcd
+// is b = det*(m11*y - m21*x) (or a = det*(m22*x - m12*y)). The
+// coefficient of x is then moved into the range 1..y/g, which makes
+// t = (s*x - g) / y non-negative too. With x = 0 there is no such
+// pair unless y = 0 as well.
 void PosInt::xgcd (PosInt& s, PosInt& t, const PosInt& x, const PosInt& y) {
-  return;
+  STATS_OP(STATS_XGCD);
+  if (y.isZero()) {
+    set(x);
+    s.set(x.isZero() ? 0 : 1);
+    t.set(0);
+    return;
+  }
+  else if (x.isZero()) 
+    throw MPError("No non-negative s and t with s*x - t*y = gcd when x is 0");
+
+  PosInt a(x), b(y);
+  GcdMatrix M;
+  if (a.compare(b) < 0) {
+    a.digits.swap(b.digits);
+    M.swapColumns();
+  }
+
+  PosInt temp[2];
+  bool divides = false;
+  while (!divides && b.digits.size() >= gcdThresholds.hgcd) {
+    hgcdTop(a, b, a.digits.size()/3, 0, &M);
+    divides = !gcdStep(a, b, 0, &M, temp);
+  }
+  while (!divides && !b.isZero())
+    divides = !gcdStep(a, b, 0, &M, temp);
+
+  // g = sign*m*x + (a multiple of y)
+  PosInt g(divides ? b : a);
+  const PosInt& m = divides ? M.m21 : M.m22;
+  bool negative = divides ? (M.det > 0) : (M.det < 0);
+
+  // s = that coefficient of x, moved into 1..y/g
+  PosInt yg, rem;
+  divrem(yg, rem, y, g);
+  PosInt sx(m);
+  sx.mod(yg);
+  if (negative && !sx.isZero()) {
+    PosInt pos(yg);
+    pos.sub(sx);
+    sx.set(pos);
+  }
+  else if (sx.isZero()) sx.set(yg);
+
+  // t = (s*x - g) / y
+  PosInt tx(sx);
+  tx.mul(x);
+  tx.sub(g);
+  divrem(t, rem, tx, y);
+  s.set(sx);
+  set(g);
+}
+
+// result = a^(-1) mod n
+void PosInt::modinv (PosInt& result, const PosInt& a, const PosInt& n) {
+  STATS_OP(STATS_MODINV);
+  if (n.isZero()) throw MPError("Divide by zero");
+  else if (n.isOne()) {
+    result.set(0);
+    return;
+  }
+
+  PosInt am(a);
+  am.mod(n);
+  if (am.isZero()) throw MPError("Not invertible");
+
+  // s*a - t*n = 1 makes s the inverse, and s is between 1 and n
+  PosInt g, s, t;
+  g.xgcd(s, t, am, n);
+  if (!g.isOne()) throw MPError("Not invertible");
+  s.mod(n);
+  result.set(s);
+}
+
+// result[i] = a[i]^(-1) mod n
+// With prefix products c[i] = a[0]*...*a[i], only c[k-1] is inverted.
+// Walking back down, c[k-1]^(-1) * c[k-2] is a[k-1]^(-1), and
+// multiplying the running inverse by a[k-1] gives c[k-2]^(-1).
+void PosInt::modinvBatch (vector<PosInt>& result, 
+  const vector<PosInt>& a, const PosInt& n)
+{
+  STATS_OP(STATS_MODINV_BATCH);
+  int k = a.size();
+  if (n.isZero()) throw MPError("Divide by zero");
+  else if (k == 0) {
+    result.clear();
+    return;
+  }
+
+  ModContext ctx(n);
+  vector<PosInt> reduced (a);
+  vector<PosInt> prefix (k);
+  for (int i=0; i<k; ++i) ctx.reduce(reduced[i]);
+  prefix[0].set(reduced[0]);
+  for (int i=1; i<k; ++i) ctx.mulmod(prefix[i], prefix[i-1], reduced[i]);
+
+  PosInt inv;
+  modinv(inv, prefix[k-1], n);
+  result.resize(k);
+  for (int i=k-1; i>0; --i) {
+    ctx.mulmod(result[i], inv, prefix[i-1]);
+    ctx.mulmod(inv, inv, reduced[i]);
+  }
+  result[0].set(inv);
 }
 
 /******************** Primality Testing ********************/
 
+// A run of the small primes whose product fits in a single digit
+struct PrimeGroup {
+  PosInt::Digit product;
+  int first, count;
+};
+
+// The odd primes below limit, by the sieve of Eratosthenes
+static vector<PosInt::Digit> makeOddPrimes (int limit) {
+  vector<bool> composite (limit, false);
+  vector<PosInt::Digit> primes;
+  for (int p = 3; p < limit; p += 2) {
+    if (composite[p]) continue;
+    primes.push_back(p);
+    for (long long m = (long long)p*p; m < limit; m += 2*p) composite[m] = true;
+  }
+  return primes;
+}
+
+// Splits primes into groups, each with as many primes as
+// will fit in a digit when multiplied together
+static vector<PrimeGroup> makePrimeGroups (const vector<PosInt::Digit>& primes) {
+  vector<PrimeGroup> groups;
+  for (int i=0; i < primes.size(); ) {
+    PrimeGroup g = { 1, i, 0 };
+    while (i < primes.size() && g.product <= ~(PosInt::Digit)0 / primes[i]) {
+      g.product *= primes[i++];
+      ++g.count;
+    }
+    groups.push_back(g);
+  }
+  return groups;
+}
+
+// The odd primes below 1000 for trial division, and below 2^16 for
+// sieving candidates in the prime search, with their groups
+static const vector<PosInt::Digit>& smallPrimes () {
+  static const vector<PosInt::Digit> primes = makeOddPrimes(1000);
+  return primes;
+}
+
+static const vector<PrimeGroup>& primeGroups () {
+  static const vector<PrimeGroup> groups = makePrimeGroups(smallPrimes());
+  return groups;
+}
+
+static const vector<PosInt::Digit>& sievePrimes () {
+  static const vector<PosInt::Digit> primes = makeOddPrimes(1 << 16);
+  return primes;
+}
+
+static const vector<PrimeGroup>& sieveGroups () {
+  static const vector<PrimeGroup> groups = makePrimeGroups(sievePrimes());
+  return groups;
+}
+
+// Sets rem to the remainders of the len digits at x by the product of
+// each group. A single pass down the digits, as divDigit does, keeps
+// all of them at once.
+static void groupRemainders (const PosInt::Digit* x, int len, 
+  const vector<PrimeGroup>& groups, vector<PosInt::Digit>& rem)
+{
+  typedef PosInt::DDigit DDigit;
+  rem.assign(groups.size(), 0);
+  for (int i = len-1; i >= 0; --i)
+    for (int g=0; g < groups.size(); ++g)
+      rem[g] = (PosInt::Digit)((((DDigit)rem[g] << 64) | x[i]) % groups[g].product);
+}
+
+// Trial division of the len digits at x by the odd primes below 1000.
+// Returns -1 if one of them divides x, 1 if x is prime (it is one of
+// them, or has no such factor and is below 1000^2), or 0 if the
+// question is still open.
+static int trialDivision (const PosInt::Digit* x, int len) {
+  typedef PosInt::Digit Digit;
+  const vector<Digit>& primes = smallPrimes();
+  const vector<PrimeGroup>& groups = primeGroups();
+
+  vector<Digit> rem;
+  groupRemainders(x, len, groups, rem);
+  for (int g=0; g < groups.size(); ++g)
+    for (int j=0; j < groups[g].count; ++j) {
+      Digit p = primes[groups[g].first + j];
+      if (rem[g] % p == 0) return len == 1 && x[0] == p ? 1 : -1;
+    }
+  return len == 1 && x[0] < 1000*1000 ? 1 : 0;
+}
+
+// Returns x mod d for the len digits at x
+static PosInt::Digit remDigit (const PosInt::Digit* x, int len, PosInt::Digit d) {
+  PosInt::Digit r = 0;
+  for (int i = len-1; i >= 0; --i)
+    r = (PosInt::Digit)((((PosInt::DDigit)r << 64) | x[i]) % d);
+  return r;
+}
+
+// Returns the Jacobi symbol (a/m), for odd m
+static int jacobiDigit (PosInt::Digit a, PosInt::Digit m) {
+  int result = 1;
+  a %= m;
+  while (a != 0) {
+    while (a % 2 == 0) {
+      a /= 2;
+      if (m % 8 == 3 || m % 8 == 5) result = -result;
+    }
+    swap(a, m);
+    if (a % 4 == 3 && m % 4 == 3) result = -result;
+    a %= m;
+  }
+  return m == 1 ? result : 0;
+}
+
+// Returns true if n is a perfect square, by Newton's iteration for
+// the square root from above
+static bool isSquare (const PosInt& n) {
+  PosInt x(2), y, two(2);
+  x.pow(PosInt((n.bitLength() + 1) / 2));
+  while (true) {
+    y.set(n);
+    y.div(x);
+    y.add(x);
+    y.div(two);
+    if (y.compare(x) >= 0) break;
+    x.set(y);
+  }
+  x.sqr();
+  return x.compare(n) == 0;
+}
+
+// x = x + y mod n, and x = x - y mod n, for x and y less than n
+static void addMod (PosInt& x, const PosInt& y, const PosInt& n) {
+  x.add(y);
+  if (x.compare(n) >= 0) x.sub(n);
+}
+
+static void subMod (PosInt& x, const PosInt& y, const PosInt& n) {
+  if (x.compare(y) < 0) x.add(n);
+  x.sub(y);
+}
+
+// Sets x to the Montgomery form of v mod n, for a small v of either sign
+static void montSmall (MontContext& ctx, PosInt& x, int v) {
+  x.set(v < 0 ? -v : v);
+  if (v < 0) {
+    PosInt neg(ctx.modulus());
+    neg.sub(x);
+    x.set(neg);
+  }
+  ctx.toMont(x);
+}
+
+// The strong probable prime test to the given base (less than n), 
+// for odd n with n - 1 = d * 2^s, done in the Montgomery form of ctx.
+// minusOne is the Montgomery form of n - 1.
+static bool strongProbablePrime (MontContext& ctx, const PosInt& base, 
+  const PosInt& d, int s, const PosInt& minusOne)
+{
+  PosInt x(base);
+  ctx.toMont(x);
+  ctx.powmod(x, x, d);
+  if (x.compare(ctx.one()) == 0 || x.compare(minusOne) == 0) return true;
+  for (int r = 1; r < s; ++r) {
+    ctx.sqrmod(x, x);
+    if (x.compare(minusOne) == 0) return true;
+    if (x.compare(ctx.one()) == 0) return false;
+  }
+  return false;
+}
+
+// The strong Lucas test with P = 1 and Q = (1 - D)/4, where D is the
+// first of 5, -7, 9, -11, ... with Jacobi symbol (D/n) = -1. With
+// n + 1 = d * 2^s, n passes if U_d = 0 or V_(d*2^r) = 0 for some r < s.
+// n must be odd and have no factors below 1000.
+bool PosInt::strongLucas (const PosInt& n, MontContext& ctx) {
+  int D = 5;
+  for (int tries = 0; ; ++tries) {
+    Digit absD = D < 0 ? -D : D;
+    int j = jacobiDigit(remDigit(&n.digits[0], n.digits.size(), absD), absD);
+    // Reciprocity turns (|D|/n) into (n/|D|), and (-1/n) = -1 
+    // when n is 3 mod 4
+    if (absD % 4 == 3 && n.digits[0] % 4 == 3) j = -j;
+    if (D < 0 && n.digits[0] % 4 == 3) j = -j;
+    if (j == -1) break;
+    if (j == 0) return false;
+    // There is no such D for a square, so rule that out 
+    // once the search has gone on for a while
+    if (tries == 8 && isSquare(n)) return false;
+    D = D < 0 ? 2 - D : -(D + 2);
+  }
+  int Q = (1 - D) / 4;
+  PosInt Dm, Qm;
+  montSmall(ctx, Dm, D);
+  montSmall(ctx, Qm, Q);
+
+  PosInt d(n);
+  d.add(PosInt(1));
+  int s = 0;
+  while (!d.testBit(s)) ++s;
+  d.shiftRight(s);
+
+  // Start from U_1 = 1 and V_1 = P = 1 and go down the bits of d, 
+  // doubling k each time and adding 1 for each 1 bit, with Qk = Q^k
+  PosInt U(ctx.one()), V(ctx.one()), Qk(Qm), DU;
+  for (int i = d.bitLength()-2; i >= 0; --i) {
+    // U_2k = U_k V_k and V_2k = V_k^2 - 2 Q^k
+    ctx.mulmod(U, U, V);
+    ctx.sqrmod(V, V);
+    subMod(V, Qk, n);
+    subMod(V, Qk, n);
+    ctx.sqrmod(Qk, Qk);
+    if (d.testBit(i)) {
+      // U_k+1 = (U_k + V_k)/2 and V_k+1 = (D U_k + V_k)/2, mod n
+      ctx.mulmod(DU, U, Dm);
+      addMod(U, V, n);
+      if (!U.isEven()) U.add(n);
+      U.shiftRight(1);
+      addMod(V, DU, n);
+      if (!V.isEven()) V.add(n);
+      V.shiftRight(1);
+      ctx.mulmod(Qk, Qk, Qm);
+    }
+  }
+
+  if (U.isZero() || V.isZero()) return true;
+  for (int r = 1; r < s; ++r) {
+    ctx.sqrmod(V, V);
+    subMod(V, Qk, n);
+    subMod(V, Qk, n);
+    if (V.isZero()) return true;
+    ctx.sqrmod(Qk, Qk);
+  }
+  return false;
+}
+
 // returns true if this is PROBABLY prime
-bool PosInt::MillerRabin () const {
+bool PosInt::MillerRabin (int rounds, bool bailliePSW) const {
+  return millerRabin(rounds, bailliePSW, false);
+}
+
+bool PosInt::millerRabin (int rounds, bool bailliePSW, bool seeded) const {
+  STATS_OP(STATS_MILLER_RABIN);
+  if (isZero() || isOne()) return false;
+  if (isEven()) return digits.size() == 1 && digits[0] == 2;
+  int small = trialDivision(&digits[0], digits.size());
+  if (small != 0) return small > 0;
+
+  // this - 1 = d * 2^s
+  PosInt d(*this);
+  d.sub(PosInt(1));
+  int s = 0;
+  while (!d.testBit(s)) ++s;
+  d.shiftRight(s);
+
+  MontContext ctx(*this);
+  PosInt minusOne(*this);
+  minusOne.sub(ctx.one());
+
+  // The first twelve primes as bases are enough to decide
+  // every number below 3.3 * 10^24, so for one digit the answer is exact
+  if (digits.size() == 1) {
+    static const int bases[12] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    for (int i=0; i<12; ++i)
+      if (!strongProbablePrime(ctx, PosInt(bases[i]), d, s, minusOne)) 
+        return false;
+    return true;
+  }
+
+  if (bailliePSW) {
+    if (!strongProbablePrime(ctx, PosInt(2), d, s, minusOne)) return false;
+    if (!strongLucas(*this, ctx)) return false;
+  }
+
+  // Random bases between 2 and this - 2. Seeded ones take a digit
+  // more than needed before reducing, so the bias is below 2^-64.
+  PosInt range(*this), base;
+  range.sub(PosInt(3));
+  Digit state = 0;
+  if (seeded)
+    for (int i=0; i<digits.size(); ++i) state = splitMix(state) ^ digits[i];
+  for (int i=0; i<rounds; ++i) {
+    if (seeded) {
+      base.digits.resize(range.digits.size() + 1);
+      for (int j=0; j<base.digits.size(); ++j) base.digits[j] = splitMix(state);
+      base.normalize();
+      base.mod(range);
+    }
+    else base.rand(range);
+    base.add(PosInt(2));
+    if (!strongProbablePrime(ctx, base, d, s, minusOne)) return false;
+  }
+  return true;
+}
+
+// The number of odd candidates sieved at a time by primeSearch
+static const int primeWindow = 4096;
+
+// Sets result to the first probable prime in start, start+2, ...
+bool PosInt::primeSearch (PosInt& result, const PosInt& start, int maxBits) {
+  // Below 2^32 a candidate could be one of the sieving primes,
+  // so just step through and test each one
+  if (start.bitLength() <= 32) {
+    PosInt c(start), two(2);
+    for (; maxBits == 0 || c.bitLength() <= maxBits; c.add(two))
+      if (c.millerRabin(25, false, true)) {
+        result.set(c);
+        return true;
+      }
+    return false;
+  }
+
+  const vector<Digit>& primes = sievePrimes();
+  const vector<PrimeGroup>& groups = sieveGroups();
+
+  // res[i] = base mod primes[i], for the first candidate of the window
+  vector<Digit> rem, res (primes.size());
+  groupRemainders(&start.digits[0], start.digits.size(), groups, rem);
+  for (int g=0; g < groups.size(); ++g)
+    for (int j=0; j < groups[g].count; ++j)
+      res[groups[g].first + j] = rem[g] % primes[groups[g].first + j];
+
+  PosInt base(start);
+  vector<char> composite (primeWindow);
+  vector<PosInt> cands;
+  while (maxBits == 0 || base.bitLength() <= maxBits) {
+    // Candidate i is base + 2i, which p divides when 
+    // i = -res/2 mod p. Then move res on to the next window.
+    composite.assign(primeWindow, 0);
+    for (int k=0; k < primes.size(); ++k) {
+      Digit p = primes[k];
+      Digit i = (p - res[k]) % p * ((p + 1) / 2) % p;
+      for (; i < primeWindow; i += p) composite[i] = 1;
+      res[k] = (res[k] + 2*primeWindow) % p;
+    }
+
+    cands.clear();
+    for (int i=0; i < primeWindow; ++i) {
+      if (composite[i]) continue;
+      PosInt c(base);
+      c.add(PosInt(2*i));
+      if (maxBits && c.bitLength() > maxBits) break;
+      cands.push_back(c);
+    }
+
+    // Test the survivors in order. With a pool, each worker claims the
+    // next untested one until one at or before it has passed; all those
+    // before the first hit still get tested, so it is the first prime.
+    // Each candidate's bases are seeded by the candidate itself, so the
+    // result doesn't depend on which worker tests it.
+    int n = cands.size();
+    int found = n;
+    if (threadPool != NULL && threadPool->size() > 1) {
+      atomic<int> next (0), hit (n);
+      TaskGroup group(*threadPool);
+      for (int t=0; t < threadPool->size(); ++t)
+        group.run([&] {
+          for (int i; (i = next++) < hit.load(); ) {
+            if (!cands[i].millerRabin(25, false, true)) continue;
+            int h = hit.load();
+            while (i < h && !hit.compare_exchange_weak(h, i)) { }
+          }
+        });
+      group.wait();
+      found = hit.load();
+    }
+    else {
+      for (found = 0; found < n; ++found)
+        if (cands[found].millerRabin(25, false, true)) break;
+    }
+
+    if (found < n) {
+      result.set(cands[found]);
+      return true;
+    }
+    base.add(PosInt(2*primeWindow));
+  }
   return false;
 }
 
+// this = the smallest probable prime greater than x
+void PosInt::nextPrime (const PosInt& x) {
+  PosInt start(x);
+  start.add(PosInt(1));
+  if (start.compare(PosInt(2)) <= 0) {
+    set(2);
+    return;
+  }
+  if (start.isEven()) start.add(PosInt(1));
+  primeSearch(*this, start, 0);
+}
+
+// this = a random probable prime of exactly the given number of bits
+void PosInt::randomPrime (int bits) {
+  if (bits < 2) throw MPError("A prime needs at least 2 bits");
+  PosInt top(2);
+  top.pow(PosInt(bits-1));
+  PosInt start;
+  do {
+    start.rand(top);
+    start.add(top);
+    if (start.isEven()) start.add(PosInt(1));
+  } while (!primeSearch(*this, start, bits));
+}
@@ -3,7 +3,16 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
 #include <exception>
+#include <stdint.h>
+#include <utility>
+#include "smallvector.h"
+
+class ThreadPool;
+class MontContext;
+class MappedPosInt;
+template <int Bits> class FixedPosInt;
 
 /* This is an exception class for the MP library. */
 class MPError :public virtual std::exception {
@@ -18,54 +27,290 @@ class MPError :public virtual std::exception {
 /* This class represents an arbitrarily large integer
  * that is at least 0. It is represented by a vector of
  * digits, starting from the least-significant digit, and
- * with each digit between 0 and B-1.
+ * with each digit a full 64-bit word, so the radix B is 2^64.
  */
 class PosInt {
+  friend class ModContext;
+  friend class MontContext;
+  friend class MappedPosInt;
+  template <int Bits> friend class FixedPosInt;
+
+  public:
+    // A single digit (limb), and a double-width type that holds
+    // the full product of two digits plus carries.
+    typedef uint64_t Digit;
+    typedef unsigned __int128 DDigit;
+
+    // Operand lengths, in digits, at which multiplication switches
+    // from schoolbook to Karatsuba, then to Toom-3, Toom-4 and the NTT.
+    struct MulThresholds {
+      int karatsuba;
+      int toom3;
+      int toom4;
+      int ntt;
+    };
+
+    // Divisor lengths, in digits, at which division switches from
+    // schoolbook to Burnikel-Ziegler, then to Newton's method.
+    struct DivThresholds {
+      int burnikelZiegler;
+      int newton;
+    };
+
+    // Operand length, in digits, at which gcd switches from Lehmer's
+    // method to the recursive half-GCD.
+    struct GcdThresholds {
+      int hgcd;
+    };
+
+    // Readings from the instrumentation (see getStats): calls to each
+    // kernel and the digits they were given, calls to each public
+    // operation and the time spent in them.
+    struct KernelStats {
+      const char* name;
+      uint64_t calls;
+      uint64_t digits;
+    };
+    struct OpStats {
+      const char* name;
+      uint64_t calls;
+      uint64_t nanoseconds;
+    };
+    struct Stats {
+      std::vector<KernelStats> kernels;
+      std::vector<OpStats> ops;
+      // Deepest Karatsuba recursion seen on any one thread
+      int maxKaratsubaDepth;
+      // Total scratch space allocated by the operations
+      uint64_t scratchBytes;
+    };
+
+    // The order of the words, and of the bytes within each word, for
+    // importWords and exportWords. NATIVE_END is this machine's order.
+    enum WordOrder { LEAST_FIRST, MOST_FIRST };
+    enum ByteOrder { LITTLE_END, BIG_END, NATIVE_END };
+
+    // The instruction sets the addition and subtraction loops can use
+    enum SimdLevel { SIMD_SCALAR, SIMD_AVX512 };
+
+    // Called with each public operation's name and time as it finishes
+    typedef void (*StatsCallback) (const char* op, uint64_t nanoseconds, void* data);
+
   private:
-    // It must ALWAYS be the case that B = Bbase ^ Bpow.
-    // B is really the one to be concerned about for arithmetic; 
-    // Bbase just determines how the number looks for I/O operations.
-    static int B;
+    // Arithmetic is always done in radix B = 2^64.
+    // Bbase just determines how the number looks for I/O operations;
+    // Bchunk = Bbase ^ Bpow is the largest power of Bbase that fits
+    // in a single Digit, and is used to convert to and from Bbase.
     static int Bbase;
     static int Bpow;
+    static Digit Bchunk;
    
-    std::vector<int> digits;
+    // Values of up to four digits (256 bits) are kept inline,
+    // without touching the heap
+    typedef SmallVector<Digit, 4> DigitVector;
+    DigitVector digits;
 
     // Removes leading 0 digits
     void normalize();
 
+    // this = this * 2^bits, or this / 2^bits rounded down
+    void shiftLeft (int bits);
+    void shiftRight (int bits);
+
+    // this = this * pow + chunk, used when reading in base Bbase
+    void mulAddChunk (Digit pow, Digit chunk);
+
+    // Sets tower to Bchunk^(2^k) for k < levels, from a cache that is
+    // kept until the base changes
+    static void powerTower (std::vector<PosInt>& tower, int levels);
+    // Appends this in base Bbase to out, padded with 0s to at least
+    // width characters, by repeated division by Bchunk
+    void printSmall (std::string& out, int width) const;
+    // Appends x, which is less than tower[k+1], in base Bbase to out,
+    // padded to Bpow * 2^(k+1) characters if pad is set. Splits x by
+    // tower[k] = Bchunk^(2^k) and converts both halves recursively.
+    static void printTower (std::string& out, const PosInt& x, 
+      const std::vector<PosInt>& tower, int k, bool pad);
+    // Sets this to the n base-Bbase subdigit values at s, splitting
+    // off the low Bpow * 2^k of them recursively by the tower
+    void readSmall (const char* s, int n);
+    void readTower (const char* s, int n, const std::vector<PosInt>& tower);
+
     // Result is -1, 0, or 1 if a is <, =, or > than b,
     // up to the specified length.
-    static int compareDigits (const int* a, int alen, const int* b, int blen);
+    static int compareDigits (const Digit* a, int alen, const Digit* b, int blen);
     // Computes dest += x, digit-wise
-    static void addArray (int* dest, const int* x, int len);
+    static void addArray (Digit* dest, const Digit* x, int len);
     // Computes dest -= x, digit-wise
-    static void subArray (int* dest, const int* x, int len);
+    static void subArray (Digit* dest, const Digit* x, int len);
+    // Computes dest = |x - y|, digit-wise, and returns true if x < y
+    static bool absDiffArray
+      (Digit* dest, const Digit* x, int xlen, const Digit* y, int ylen, int len);
     // Computes dest = x * y, digit-wise
     static void mulArray 
-      (int* dest, const int* x, int xlen, const int* y, int ylen);
+      (Digit* dest, const Digit* x, int xlen, const Digit* y, int ylen);
     // Computes dest = x * y, digit-wise, using Karatsuba's method 
-    // x and y must be same length
+    // x and y must be same length, and scratch must have room for
+    // fastMulScratch(len) digits.
     static void fastMulArray
-      (int* dest, const int* x, const int* y, int len);
+      (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch);
+    // Returns the scratch size needed by fastMulArray
+    static int fastMulScratch (int len);
+    // Computes dest = x * y, digit-wise, using Toom-Cook 3-way
+    // x and y must be same length, with scratch for toom3Scratch(len)
+    static void toom3MulArray
+      (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch);
+    static int toom3Scratch (int len);
+    // Computes dest = x * y, digit-wise, using Toom-Cook 4-way
+    // x and y must be same length, with scratch for toom4Scratch(len)
+    static void toom4MulArray
+      (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch);
+    static int toom4Scratch (int len);
+    // Multiplies two Toom-Cook evaluations in two's complement
+    static void toomPointMul
+      (Digit* dest, Digit* e, Digit* f, int len, Digit* scratch);
+    // Computes dest = x * y for same-length x and y, choosing between
+    // Karatsuba and Toom-Cook by length
+    static void balancedMulArray
+      (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch);
+    static int balancedMulScratch (int len);
+    // Computes dest = x * y, digit-wise, using a number-theoretic
+    // transform modulo three primes, with scratch for nttScratch
+    static void nttMulArray (Digit* dest, 
+      const Digit* x, int xlen, const Digit* y, int ylen, Digit* scratch);
+    static int nttScratch (int xlen, int ylen);
+    // Computes dest = x * y for operands of any lengths, picking the
+    // algorithm by the shorter length the way mul does, with scratch
+    // for unbalancedMulScratch(xlen, ylen)
+    static void unbalancedMulArray (Digit* dest, 
+      const Digit* x, int xlen, const Digit* y, int ylen, Digit* scratch);
+    static int unbalancedMulScratch (int xlen, int ylen);
+    // Computes dest = x * y, digit-wise, using Karatsuba's method with
+    // the recursive products run in parallel on the thread pool
+    static void parFastMulArray
+      (Digit* dest, const Digit* x, const Digit* y, int len, Digit* scratch);
+    static int parFastMulScratch (int len);
+    // Computes dest = x * x, digit-wise
+    static void sqrArray (Digit* dest, const Digit* x, int len);
+    // Computes dest = x * x, digit-wise, using Karatsuba's method,
+    // with scratch for fastMulScratch(len)
+    static void fastSqrArray (Digit* dest, const Digit* x, int len, Digit* scratch);
+    // Computes dest = x * x, choosing between Karatsuba and Toom-Cook
+    // by length, with scratch for balancedMulScratch(len)
+    static void balancedSqrArray (Digit* dest, const Digit* x, int len, Digit* scratch);
     // Computes dest = dest * d, digit-wise
-    static void mulDigit (int* dest, int d, int len);
+    static void mulDigit (Digit* dest, Digit d, int len);
     // Computes dest = dest / d, digit-wise, and returns dest % d
-    static int divDigit (int* dest, int d, int len);
-    // Computes division with remainder, digit-wise.
-    static void divremArray 
-      (int* q, int* r, const int* x, int xlen, const int* y, int ylen);
+    static Digit divDigit (Digit* dest, Digit d, int len);
+    // Computes division with remainder, digit-wise, with scratch
+    // for ylen+1 digits.
+    static void divremArray (Digit* q, Digit* r, const Digit* x, int xlen,
+      const Digit* y, int ylen, Digit* scratch);
+    // Computes division with remainder, digit-wise, with the same
+    // requirements as divremArray, using Burnikel-Ziegler or Newton
+    // division when the operands are long enough.
+    static void fastDivremArray 
+      (Digit* q, Digit* r, const Digit* x, int xlen, const Digit* y, int ylen);
+    // Divides the n+r digits at np by the n-digit divisor d, recursively,
+    // with scratch for bzScratch(n, r). The low r quotient digits go in q,
+    // the top one is returned, and the remainder is left in np[0..n).
+    static Digit bzDivremArray 
+      (Digit* q, Digit* np, const Digit* d, int n, int r, Digit* scratch);
+    static int bzScratch (int n, int r);
+    // Divides the 2n digits at np by the n-digit divisor d, given its
+    // reciprocal from reciprocalArray, with scratch for 4n digits plus
+    // unbalancedMulScratch(n, n). The top n digits of np must be less
+    // than d. The quotient goes in q and the remainder in np[0..n).
+    static void newtonDivremArray (Digit* q, Digit* np, 
+      const Digit* d, int n, const Digit* inv, Digit* scratch);
+    // Computes the n+1 digit reciprocal X of the n-digit divisor d, with
+    // d*X < B^(2n) <= d*(X+2), by Newton's iteration.
+    static void reciprocalArray (Digit* dest, const Digit* d, int n);
+
+    // A 2x2 matrix of non-negative cofactors, used by the GCD routines
+    struct GcdMatrix;
+    // dest = u*x + v*y, or u*x - v*y if subtract is set (and the
+    // result is non-negative). dest must be distinct from x and y.
+    static void linComb (PosInt& dest, 
+      const PosInt& x, Digit u, const PosInt& y, Digit v, bool subtract);
+    // One step of Lehmer's GCD on a >= b, or a division step when
+    // that fails, never taking the smaller number below B^s.
+    // Returns false if no such step is possible.
+    static bool gcdStep (PosInt& a, PosInt& b, int s, GcdMatrix* M, PosInt* temp);
+    // Half-GCD: reduces a and b as far as possible without the smaller
+    // going below B^s, and sets M to the matrix of the reduction.
+    static void hgcd (PosInt& a, PosInt& b, int s, GcdMatrix& M);
+    // Runs hgcd on a and b without their low p digits, and applies the
+    // resulting matrix to all of a and b, and to M unless it is NULL.
+    static void hgcdTop (PosInt& a, PosInt& b, int p, int s, GcdMatrix* M);
+    // Computes dest = x * y / B^len mod n, digit-wise, for odd n
+    static void montMulArray (Digit* dest, const Digit* x, const Digit* y, 
+      const Digit* n, int len, Digit ninv, Digit* prod, Digit* scratch);
+    // The strong Lucas probable prime test on odd n, with Selfridge's
+    // parameters, done in the Montgomery form of ctx (whose modulus is n)
+    static bool strongLucas (const PosInt& n, MontContext& ctx);
+    // MillerRabin, with the random bases drawn from rand() or, if seeded,
+    // from a generator seeded by this number. The seeded form is safe to
+    // run on several threads at once, and always gives the same answer.
+    bool millerRabin (int rounds, bool bailliePSW, bool seeded) const;
+    // Sets result to the first probable prime in start, start+2, ...,
+    // for odd start, sieving windows of candidates by small primes and
+    // testing the survivors on the thread pool. Returns false if there
+    // is none below 2^maxBits (with maxBits 0 for no limit).
+    static bool primeSearch (PosInt& result, const PosInt& start, int maxBits);
 
   public:
     // Computes division with remainder. After the call, we have
     // x = q*y + r, and 0 <= r < y.
     static void divrem (PosInt& q, PosInt& r, const PosInt& x, const PosInt& y);
 
-    // Sets the base to base^pow.
-    // You don't want to call this function after you've constructed
-    // any PosInt objects!
+    // Sets the base used by print and read (between 2 and 36).
+    // The arithmetic radix is always 2^64, so this can be changed
+    // at any time; pow is accepted for compatibility and ignored.
     static void setBase(int base, int pow=1);
 
+    // Gets or sets the multiplication thresholds.
+    // The defaults come from tuning.h, which "make tune" writes.
+    static MulThresholds getMulThresholds ();
+    static void setMulThresholds (const MulThresholds& t);
+
+    // Gets or sets the division thresholds, which also come from tuning.h.
+    static DivThresholds getDivThresholds ();
+    static void setDivThresholds (const DivThresholds& t);
+
+    // Gets or sets the GCD threshold, which also comes from tuning.h.
+    static GcdThresholds getGcdThresholds ();
+    static void setGcdThresholds (const GcdThresholds& t);
+
+    // Gets or sets the instruction set used by the digit loops of
+    // addition and subtraction. It starts at SIMD_SCALAR, which
+    // measured a few percent faster inside whole multiplications and
+    // divisions than AVX-512. A level the CPU doesn't support is
+    // lowered to one it does. Set it before any concurrent use.
+    static SimdLevel getSimdLevel ();
+    static void setSimdLevel (SimdLevel level);
+
+    // Parallel multiplication. Once a pool with more than one worker is
+    // set, products of at least the grain size (in digits) are split
+    // into tasks on it. setThreads(n) makes PosInt use its own pool of
+    // n workers (0 for one per hardware thread, 1 to turn it off), and
+    // setThreadPool shares a pool owned by the caller (NULL to turn off).
+    static void setThreads (int threads);
+    static void setThreadPool (ThreadPool* pool);
+    static ThreadPool* getThreadPool ();
+    static void setParallelGrain (int len);
+
+    // Instrumentation, which is only compiled in when the library is
+    // built with -DPOSINT_STATS; without it, the readings stay zero and
+    // the callback is never called. Operations called from inside other
+    // operations are counted and timed as well. getStats takes a
+    // snapshot of the readings so far, and resetStats clears them.
+    // setStatsCallback installs fn (NULL to remove it), to be called from
+    // whichever thread did the operation; set it while no operations run.
+    static void getStats (Stats& s);
+    static void resetStats ();
+    static void setStatsCallback (StatsCallback fn, void* data = NULL);
+
     // Default constructor. Initializes to zero
     PosInt() { }
 
@@ -81,6 +326,24 @@ class PosInt {
     void read(std::istream& in);
     void read(const char* s);
 
+    // Binary I/O, like GMP's mpz_import and mpz_export. importWords sets
+    // this to the count words of size bytes each at data. exportWords
+    // writes this to data as exportSize(size) words of size bytes (none
+    // for zero), and returns how many it wrote. Little-endian 64-bit
+    // words with the least significant first are simply copied.
+    void importWords (const void* data, size_t count, int size, 
+      WordOrder order = LEAST_FIRST, ByteOrder endian = NATIVE_END);
+    size_t exportWords (void* data, int size, 
+      WordOrder order = LEAST_FIRST, ByteOrder endian = NATIVE_END) const;
+    size_t exportSize (int size) const;
+
+    // Writes this to, or reads it from, a file in PosInt's binary format:
+    // a 32-byte header and then the digits as little-endian 64-bit words,
+    // least significant first (see MappedPosInt). Throws MPError if the
+    // file can't be written or read, or isn't in that format.
+    void save (const char* filename) const;
+    void load (const char* filename);
+
     // Sets this PosInt to the given value
     void set (int x);
     void set (const PosInt& rhs);
@@ -97,6 +360,10 @@ class PosInt {
       { return digits.size() == 1 && digits[0] == 1; }
     bool isEven() const;
 
+    // Number of bits (0 for zero), and the value of bit i
+    int bitLength() const;
+    bool testBit(int i) const;
+
     // Result is -1, 0, or 1 if this is <, =, or > than rhs.
     int compare (const PosInt& x) const;
 
@@ -106,12 +373,23 @@ class PosInt {
     // this = this - x
     void sub (const PosInt& x);
 
-    // this = this * x
+    // this = this * x, picking the algorithm by operand size
     void mul (const PosInt& x);
 
+    // Three-address forms: dest = a + b, a - b, or a * b. The result
+    // is written straight into dest's buffer, and dest may be the
+    // same as either operand.
+    static void add (PosInt& dest, const PosInt& a, const PosInt& b);
+    static void sub (PosInt& dest, const PosInt& a, const PosInt& b);
+    static void mul (PosInt& dest, const PosInt& a, const PosInt& b);
+
     // this = this * x, using Karatsuba's method
+    // (or Toom-Cook for large operands)
     void fastMul (const PosInt& x);
 
+    // this = this * this
+    void sqr ();
+
     // this = this / y
     void div (const PosInt& x)
       { PosInt temp; divrem(*this, temp, *this, x); }
@@ -123,8 +401,28 @@ class PosInt {
     // this = this ^ x
     void pow (const PosInt& x);
 
+    // Compound operators, the same as the calls above. Shifts are by
+    // a number of bits, which can't be negative.
+    PosInt& operator+= (const PosInt& x) { add(x); return *this; }
+    PosInt& operator-= (const PosInt& x) { sub(x); return *this; }
+    PosInt& operator*= (const PosInt& x) { mul(x); return *this; }
+    PosInt& operator/= (const PosInt& x) { div(x); return *this; }
+    PosInt& operator%= (const PosInt& x) { mod(x); return *this; }
+    PosInt& operator<<= (int bits);
+    PosInt& operator>>= (int bits);
+
     // result = a^b mod n
-    void powmod (PosInt& result, const PosInt& a, const PosInt& b, const PosInt& n);
+    static void powmod 
+      (PosInt& result, const PosInt& a, const PosInt& b, const PosInt& n);
+
+    // Batches of independent jobs, spread over the thread pool when one
+    // is set: result[i] = a[i] * b[i], and result[i] = a[i]^e[i] mod n
+    // with a single modulus (and a single exponent if e has one entry).
+    // Throws MPError if the lengths don't match.
+    static void mulBatch (std::vector<PosInt>& result, 
+      const std::vector<PosInt>& a, const std::vector<PosInt>& b);
+    static void powmodBatch (std::vector<PosInt>& result, 
+      const std::vector<PosInt>& a, const std::vector<PosInt>& e, const PosInt& n);
 
     // this = gcd(x,y)
     void gcd (const PosInt& x, const PosInt& y);
@@ -134,10 +432,171 @@ class PosInt {
     // always non-negative.
     void xgcd (PosInt& s, PosInt& t, const PosInt& x, const PosInt& y);
 
-    // return true/false if this is PROBABLY prime
-    bool MillerRabin () const;
+    // result = a^(-1) mod n. Throws MPError if a and n are not coprime.
+    static void modinv (PosInt& result, const PosInt& a, const PosInt& n);
+
+    // result[i] = a[i]^(-1) mod n for each i, with a single modinv and
+    // 3(k-1) modular multiplications for k values (Montgomery's trick).
+    // Throws MPError if any of them is not coprime to n.
+    static void modinvBatch (std::vector<PosInt>& result, 
+      const std::vector<PosInt>& a, const PosInt& n);
+
+    // return true/false if this is PROBABLY prime. Small factors are
+    // found by trial division, and numbers below 2^64 are tested with a
+    // fixed set of bases that makes the answer exact. Above that, rounds
+    // random bases are tried; with bailliePSW set, these come after a
+    // base-2 test and a strong Lucas test (Baillie-PSW), so rounds can be 0.
+    bool MillerRabin (int rounds = 25, bool bailliePSW = false) const;
+
+    // this = the smallest probable prime greater than x
+    void nextPrime (const PosInt& x);
+
+    // this = a random probable prime of exactly the given number of
+    // bits, the first one after a random starting point
+    void randomPrime (int bits);
+};
+
+/* A modulus prepared for repeated reductions with Barrett's method.
+ * Building it costs one division, to find the reciprocal
+ * mu = floor((B^(2k) - 1) / n) for an n of k digits. After that,
+ * reducing a number of up to 2k digits takes two multiplications.
+ * All the work is done in buffers owned by the context, so one
+ * context must not be used by two threads at once.
+ */
+class ModContext {
+  public:
+    explicit ModContext (const PosInt& modulus);
+
+    const PosInt& modulus () const { return n; }
+
+    // x = x mod n
+    void reduce (PosInt& x);
+
+    // result = a * b mod n
+    void mulmod (PosInt& result, const PosInt& a, const PosInt& b);
+
+    // result = a * a mod n
+    void sqrmod (PosInt& result, const PosInt& a);
+
+  private:
+    PosInt n;
+    int k;
+    std::vector<PosInt::Digit> mu, npad;
+    std::vector<PosInt::Digit> abuf, bbuf, xbuf, q2, prod, r, scratch;
+
+    // Sets r to xbuf mod n
+    void reduceBuffer ();
 };
 
+/* An odd modulus prepared for Montgomery multiplication. A number x
+ * less than n, for an n of k digits, is kept in Montgomery form
+ * x*B^k mod n, where a product can be reduced by adding multiples
+ * of n instead of dividing. Building the context costs one division,
+ * for B^(2k) mod n. Like ModContext, it works in its own buffers,
+ * so one context must not be used by two threads at once.
+ */
+class MontContext {
+  public:
+    // Throws MPError if the modulus is even
+    explicit MontContext (const PosInt& modulus);
+
+    const PosInt& modulus () const { return n; }
+
+    // The Montgomery form of 1
+    const PosInt& one () const { return r1; }
+
+    // x = x * B^k mod n, which puts x (less than n) into Montgomery 
+    // form, and x = x / B^k mod n, which takes it back out
+    void toMont (PosInt& x);
+    void fromMont (PosInt& x);
+
+    // result = a * b / B^k mod n, the product of a and b in 
+    // Montgomery form
+    void mulmod (PosInt& result, const PosInt& a, const PosInt& b);
+
+    // result = a * a / B^k mod n
+    void sqrmod (PosInt& result, const PosInt& a);
+
+    // result = a^e, with a and the result in Montgomery form
+    void powmod (PosInt& result, const PosInt& a, const PosInt& e);
+
+  private:
+    PosInt n;
+    int k;
+    PosInt::Digit ninv;
+    PosInt r1, r2;
+    std::vector<PosInt::Digit> abuf, bbuf, prod, scratch;
+
+    // Copies x into buf, padded with zeros to k digits
+    void load (std::vector<PosInt::Digit>& buf, const PosInt& x);
+    // Sets result to the Montgomery product of abuf and bbuf
+    void mulBuffers (PosInt& result, bool square);
+};
+
+/* A read-only PosInt over a file written by PosInt::save, which is
+ * mapped into memory instead of being read. Opening it costs nothing
+ * up front, however large the number, and its pages are only loaded as
+ * they are used. The value must not be used once the MappedPosInt is
+ * gone; copy it to keep it. Throws MPError if the file can't be opened
+ * or isn't in the right format.
+ */
+class MappedPosInt {
+  public:
+    explicit MappedPosInt (const char* filename);
+    ~MappedPosInt ();
+
+    const PosInt& value () const { return x; }
+
+  private:
+    PosInt x;
+    void* base;
+    size_t length;
+
+    MappedPosInt (const MappedPosInt&);
+    MappedPosInt& operator= (const MappedPosInt&);
+};
+
+/* Binary operators. Each one with an rvalue operand does its work in
+ * that operand's storage and moves it into the result, so a chained
+ * expression such as a*b + c*d - e allocates only for the products.
+ */
+inline PosInt operator+ (const PosInt& a, const PosInt& b)
+  { PosInt r; PosInt::add(r, a, b); return r; }
+inline PosInt operator+ (PosInt&& a, const PosInt& b)
+  { a += b; return std::move(a); }
+inline PosInt operator+ (const PosInt& a, PosInt&& b)
+  { b += a; return std::move(b); }
+inline PosInt operator+ (PosInt&& a, PosInt&& b)
+  { a += b; return std::move(a); }
+
+inline PosInt operator- (const PosInt& a, const PosInt& b)
+  { PosInt r; PosInt::sub(r, a, b); return r; }
+inline PosInt operator- (PosInt&& a, const PosInt& b)
+  { a -= b; return std::move(a); }
+
+inline PosInt operator* (const PosInt& a, const PosInt& b)
+  { PosInt r; PosInt::mul(r, a, b); return r; }
+inline PosInt operator* (PosInt&& a, const PosInt& b)
+  { a *= b; return std::move(a); }
+inline PosInt operator* (const PosInt& a, PosInt&& b)
+  { b *= a; return std::move(b); }
+inline PosInt operator* (PosInt&& a, PosInt&& b)
+  { a *= b; return std::move(a); }
+
+inline PosInt operator/ (const PosInt& a, const PosInt& b)
+  { PosInt q, r; PosInt::divrem(q, r, a, b); return q; }
+inline PosInt operator% (const PosInt& a, const PosInt& b)
+  { PosInt q, r; PosInt::divrem(q, r, a, b); return r; }
+
+inline PosInt operator<< (const PosInt& a, int bits)
+  { PosInt r(a); r <<= bits; return r; }
+inline PosInt operator<< (PosInt&& a, int bits)
+  { a <<= bits; return std::move(a); }
+inline PosInt operator>> (const PosInt& a, int bits)
+  { PosInt r(a); r >>= bits; return r; }
+inline PosInt operator>> (PosInt&& a, int bits)
+  { a >>= bits; return std::move(a); }
+
 std::ostream& operator<< (std::ostream& out, const PosInt& x);
 std::istream& operator>> (std::istream& out, PosInt& x);
 
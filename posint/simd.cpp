@@ -0,0 +1,180 @@
+#include <atomic>
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#define SIMD_X86 1
+#endif
+
+typedef uint64_t Digit;
+typedef unsigned __int128 DDigit;
+
+// Below this many digits the vector kernels hand everything to the
+// scalar ones. In isolation they win from about 24 digits; inside
+// whole operations they do best from about 64.
+static const int vectorMinLength = 64;
+
+/******************** SCALAR ********************/
+
+// Each kernel takes the carry (or borrow) into its lowest digit, so
+// the vector kernels can finish their last few digits with it.
+
+#ifdef SIMD_X86
+
+// The carry chain runs through the add-with-carry instruction
+static Digit addScalar (Digit* dest, const Digit* x, int len, Digit carry) {
+  typedef unsigned long long ull;
+  unsigned char c = carry;
+  int i = 0;
+  for (; i+4 <= len; i += 4) {
+    c = _addcarry_u64(c, dest[i], x[i], (ull*)&dest[i]);
+    c = _addcarry_u64(c, dest[i+1], x[i+1], (ull*)&dest[i+1]);
+    c = _addcarry_u64(c, dest[i+2], x[i+2], (ull*)&dest[i+2]);
+    c = _addcarry_u64(c, dest[i+3], x[i+3], (ull*)&dest[i+3]);
+  }
+  for (; i < len; ++i)
+    c = _addcarry_u64(c, dest[i], x[i], (ull*)&dest[i]);
+  return c;
+}
+
+static Digit subScalar (Digit* dest, const Digit* x, int len, Digit borrow) {
+  typedef unsigned long long ull;
+  unsigned char b = borrow;
+  int i = 0;
+  for (; i+4 <= len; i += 4) {
+    b = _subborrow_u64(b, dest[i], x[i], (ull*)&dest[i]);
+    b = _subborrow_u64(b, dest[i+1], x[i+1], (ull*)&dest[i+1]);
+    b = _subborrow_u64(b, dest[i+2], x[i+2], (ull*)&dest[i+2]);
+    b = _subborrow_u64(b, dest[i+3], x[i+3], (ull*)&dest[i+3]);
+  }
+  for (; i < len; ++i)
+    b = _subborrow_u64(b, dest[i], x[i], (ull*)&dest[i]);
+  return b;
+}
+
+#else
+
+static Digit addScalar (Digit* dest, const Digit* x, int len, Digit carry) {
+  for (int i=0; i < len; ++i) {
+    DDigit sum = (DDigit)dest[i] + x[i] + carry;
+    dest[i] = (Digit)sum;
+    carry = (Digit)(sum >> 64);
+  }
+  return carry;
+}
+
+static Digit subScalar (Digit* dest, const Digit* x, int len, Digit borrow) {
+  for (int i=0; i < len; ++i) {
+    DDigit diff = (DDigit)dest[i] - x[i] - borrow;
+    dest[i] = (Digit)diff;
+    borrow = (Digit)(diff >> 64) & 1;
+  }
+  return borrow;
+}
+
+#endif
+
+#ifdef SIMD_X86
+
+/******************** AVX-512 ********************/
+
+// Eight lanes at a time, with the compares giving the lane masks
+
+__attribute__((target("avx512f")))
+static Digit addAvx512 (Digit* dest, const Digit* x, int len) {
+  if (len < vectorMinLength) return addScalar(dest, x, len, 0);
+  const __m512i ones = _mm512_set1_epi64(-1);
+  unsigned carry = 0;
+  int i = 0;
+  for (; i+8 <= len; i += 8) {
+    __m512i a = _mm512_loadu_si512(dest + i);
+    __m512i b = _mm512_loadu_si512(x + i);
+    __m512i s = _mm512_add_epi64(a, b);
+    unsigned g = _mm512_cmplt_epu64_mask(s, a);
+    unsigned p = _mm512_cmpeq_epi64_mask(s, ones);
+    unsigned c = (((g << 1) | carry) + p) ^ p;
+    s = _mm512_mask_sub_epi64(s, (__mmask8)c, s, ones);
+    _mm512_storeu_si512(dest + i, s);
+    carry = c >> 8;
+  }
+  return addScalar(dest + i, x + i, len - i, carry);
+}
+
+__attribute__((target("avx512f")))
+static Digit subAvx512 (Digit* dest, const Digit* x, int len) {
+  if (len < vectorMinLength) return subScalar(dest, x, len, 0);
+  const __m512i ones = _mm512_set1_epi64(-1);
+  const __m512i zero = _mm512_setzero_si512();
+  unsigned borrow = 0;
+  int i = 0;
+  for (; i+8 <= len; i += 8) {
+    __m512i a = _mm512_loadu_si512(dest + i);
+    __m512i b = _mm512_loadu_si512(x + i);
+    __m512i d = _mm512_sub_epi64(a, b);
+    unsigned g = _mm512_cmplt_epu64_mask(a, b);
+    unsigned p = _mm512_cmpeq_epi64_mask(d, zero);
+    unsigned c = (((g << 1) | borrow) + p) ^ p;
+    d = _mm512_mask_add_epi64(d, (__mmask8)c, d, ones);
+    _mm512_storeu_si512(dest + i, d);
+    borrow = c >> 8;
+  }
+  return subScalar(dest + i, x + i, len - i, borrow);
+}
+
+#endif
+
+/******************** DISPATCH ********************/
+
+static Digit addPlain (Digit* dest, const Digit* x, int len)
+  { return addScalar(dest, x, len, 0); }
+static Digit subPlain (Digit* dest, const Digit* x, int len)
+  { return subScalar(dest, x, len, 0); }
+
+typedef Digit (*Kernel) (Digit*, const Digit*, int);
+
+// The kernels in use. The AVX-512 ones beat the scalar add-with-carry
+// chain on long runs in isolation, but inside whole multiplications
+// and divisions they come out a few percent slower, so they are only
+// used when asked for. The pointers are atomic so that setting them
+// can't tear a read on another thread; relaxed loads cost no more
+// than plain ones.
+static std::atomic<PosInt::SimdLevel> level (PosInt::SIMD_SCALAR);
+static std::atomic<Kernel> addKernel (addPlain);
+static std::atomic<Kernel> subKernel (subPlain);
+
+// Returns the best level this CPU supports
+static PosInt::SimdLevel simdSupported () {
+#ifdef SIMD_X86
+  if (__builtin_cpu_supports("avx512f")) return PosInt::SIMD_AVX512;
+#endif
+  return PosInt::SIMD_SCALAR;
+}
+
+PosInt::SimdLevel simdLevel () {
+  return level;
+}
+
+void setSimdKernels (PosInt::SimdLevel want) {
+  PosInt::SimdLevel best = simdSupported();
+  PosInt::SimdLevel use = want < best ? want : best;
+  Kernel add = addPlain;
+  Kernel sub = subPlain;
+#ifdef SIMD_X86
+  if (use == PosInt::SIMD_AVX512) {
+    add = addAvx512;
+    sub = subAvx512;
+  }
+#endif
+  level = use;
+  addKernel.store(add, std::memory_order_relaxed);
+  subKernel.store(sub, std::memory_order_relaxed);
+}
+
+Digit simdAdd (Digit* dest, const Digit* x, int len) {
+  return addKernel.load(std::memory_order_relaxed)(dest, x, len);
+}
+
+Digit simdSub (Digit* dest, const Digit* x, int len) {
+  return subKernel.load(std::memory_order_relaxed)(dest, x, len);
+}
@@ -0,0 +1,27 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "posint.h"
+
+/* Vectorized versions of the addition and subtraction loops at the
+ * bottom of PosInt's arithmetic, used only inside posint.cpp.
+ * Each lane adds (or subtracts) its own digits, and the carries
+ * between lanes are then resolved all at once by carry lookahead on
+ * the lane masks: with G the lanes whose sum wrapped around and P the
+ * lanes that are all ones, the lanes that receive a carry are
+ * ((G << 1 | carry in) + P) ^ P, and the bit above the top lane is
+ * the carry out.
+ */
+
+// Gets the level in use, or sets it, lowering a level the CPU does
+// not support to one it does
+PosInt::SimdLevel simdLevel ();
+void setSimdKernels (PosInt::SimdLevel level);
+
+// dest += x over len digits; returns the carry out of the top digit
+uint64_t simdAdd (uint64_t* dest, const uint64_t* x, int len);
+
+// dest -= x over len digits; returns the borrow out of the top digit
+uint64_t simdSub (uint64_t* dest, const uint64_t* x, int len);
+
+#endif // SIMD_H
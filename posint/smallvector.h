@@ -0,0 +1,176 @@
+#ifndef SMALLVECTOR_H
+#define SMALLVECTOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+
+/* A vector of plain values that keeps up to N of them inside the
+ * object itself, and only allocates from the heap once it grows past
+ * that. It has the part of std::vector's interface that PosInt uses.
+ * Getting shorter never gives memory back, so a number keeps its
+ * capacity when it is normalized or set to a smaller value.
+ * Growing leaves new elements zero, as std::vector does.
+ * It can also borrow values that belong to someone else (see borrow).
+ */
+template <class T, int N>
+class SmallVector {
+  public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    SmallVector () :buf(local), len(0), cap(N), borrowed(false) { }
+
+    SmallVector (const SmallVector& rhs) 
+      :buf(local), len(0), cap(N), borrowed(false)
+      { assign(rhs.begin(), rhs.end()); }
+
+    // Takes over the heap buffer of rhs, if it has one
+    SmallVector (SmallVector&& rhs) 
+      :buf(local), len(0), cap(N), borrowed(false)
+      { take(rhs); }
+
+    ~SmallVector () { release(); }
+
+    SmallVector& operator= (const SmallVector& rhs) {
+      if (this != &rhs) assign(rhs.begin(), rhs.end());
+      return *this;
+    }
+
+    SmallVector& operator= (SmallVector&& rhs) {
+      if (this != &rhs) {
+        if (rhs.buf != rhs.local) release();
+        take(rhs);
+      }
+      return *this;
+    }
+
+    size_t size () const { return len; }
+    size_t capacity () const { return cap; }
+    bool empty () const { return len == 0; }
+
+    T* data () { return buf; }
+    const T* data () const { return buf; }
+    iterator begin () { return buf; }
+    iterator end () { return buf + len; }
+    const_iterator begin () const { return buf; }
+    const_iterator end () const { return buf + len; }
+
+    T& operator[] (size_t i) { return buf[i]; }
+    const T& operator[] (size_t i) const { return buf[i]; }
+    T& back () { return buf[len-1]; }
+    const T& back () const { return buf[len-1]; }
+
+    void clear () { len = 0; }
+
+    // Makes room for at least n values
+    void reserve (size_t n) {
+      if (n > cap) reallocate(n);
+    }
+
+    void resize (size_t n, const T& value = T()) {
+      if (n > cap) reallocate(std::max(n, 2*cap));
+      if (n > len) std::fill(buf + len, buf + n, value);
+      len = n;
+    }
+
+    void push_back (const T& value) {
+      if (len == cap) reallocate(std::max(2*cap, (size_t)N));
+      buf[len++] = value;
+    }
+
+    void pop_back () { --len; }
+
+    void assign (size_t n, const T& value) {
+      reserve(n);
+      std::fill(buf, buf + n, value);
+      len = n;
+    }
+
+    // The range may lie inside this vector
+    template <class It>
+    typename std::enable_if<!std::is_integral<It>::value>::type
+    assign (It first, It last) {
+      size_t n = std::distance(first, last);
+      if (n > cap) {
+        T* fresh = new T[n];
+        std::copy(first, last, fresh);
+        release();
+        buf = fresh;
+        cap = n;
+      }
+      else std::copy(first, last, buf);
+      len = n;
+    }
+
+    // Uses the n values at data, which belong to the caller, in place
+    // of our own. They must outlive this vector, and are never freed;
+    // if they are read-only, the vector must only be used as const.
+    void borrow (T* data, size_t n) {
+      release();
+      buf = data;
+      len = cap = n;
+      borrowed = true;
+    }
+
+    void swap (SmallVector& rhs) {
+      if (buf != local && rhs.buf != rhs.local) {
+        std::swap(buf, rhs.buf);
+        std::swap(len, rhs.len);
+        std::swap(cap, rhs.cap);
+        std::swap(borrowed, rhs.borrowed);
+      }
+      else {
+        SmallVector temp (std::move(rhs));
+        rhs = std::move(*this);
+        *this = std::move(temp);
+      }
+    }
+
+  private:
+    T* buf;
+    size_t len, cap;
+    bool borrowed;
+    T local[N];
+
+    // Moves the contents to a heap buffer of n values
+    void reallocate (size_t n) {
+      T* fresh = new T[n];
+      std::copy(buf, buf + len, fresh);
+      release();
+      buf = fresh;
+      cap = n;
+    }
+
+    // Frees the heap buffer, if any, and goes back to the local one
+    void release () {
+      if (buf != local && !borrowed) delete[] buf;
+      buf = local;
+      cap = N;
+      borrowed = false;
+    }
+
+    // Takes the contents of rhs, which must not share our heap buffer,
+    // and leaves it empty. Our own heap buffer is kept if rhs is local.
+    void take (SmallVector& rhs) {
+      if (rhs.buf != rhs.local) {
+        buf = rhs.buf;
+        cap = rhs.cap;
+        len = rhs.len;
+        borrowed = rhs.borrowed;
+        rhs.buf = rhs.local;
+        rhs.cap = N;
+        rhs.borrowed = false;
+      }
+      else {
+        reserve(rhs.len);
+        std::copy(rhs.buf, rhs.buf + rhs.len, buf);
+        len = rhs.len;
+      }
+      rhs.len = 0;
+    }
+};
+
+#endif // SMALLVECTOR_H
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+
+/* Hooks for the counters behind PosInt::getStats, used only inside
+ * posint.cpp. They do something only when the library is built with
+ * -DPOSINT_STATS; otherwise each one is an empty statement, and
+ * nothing at all is compiled into the kernels or the operations.
+ */
+
+// The kernels that are counted, in the order of their names in
+// posint.cpp
+enum StatsKernel {
+  STATS_ADD_ARRAY, STATS_SUB_ARRAY, STATS_MUL_ARRAY, STATS_SQR_ARRAY,
+  STATS_FAST_MUL_ARRAY, STATS_FAST_SQR_ARRAY, STATS_TOOM3_MUL_ARRAY,
+  STATS_TOOM4_MUL_ARRAY, STATS_NTT_MUL_ARRAY, STATS_PAR_FAST_MUL_ARRAY,
+  STATS_MUL_DIGIT, STATS_DIV_DIGIT, STATS_DIVREM_ARRAY,
+  STATS_BZ_DIVREM_ARRAY, STATS_NEWTON_DIVREM_ARRAY, STATS_MONT_MUL_ARRAY,
+  STATS_KERNELS
+};
+
+// The public operations that are timed, likewise
+enum StatsOp {
+  STATS_ADD, STATS_SUB, STATS_MUL, STATS_FAST_MUL, STATS_SQR,
+  STATS_DIVREM, STATS_POW, STATS_POWMOD, STATS_GCD, STATS_XGCD,
+  STATS_MODINV, STATS_PRINT, STATS_READ, STATS_MILLER_RABIN,
+  STATS_MUL_BATCH, STATS_POWMOD_BATCH, STATS_MODINV_BATCH,
+  STATS_OPS
+};
+
+#ifdef POSINT_STATS
+
+// Counts a call to kernel k on len digits
+void statsKernel (StatsKernel k, long len);
+
+// Counts digits of scratch space allocated
+void statsScratch (long digits);
+
+// Adds a level of Karatsuba recursion on this thread while it exists
+struct StatsDepth {
+  StatsDepth ();
+  ~StatsDepth ();
+};
+
+// Times operation op from its construction to its destruction
+struct StatsTimer {
+  explicit StatsTimer (StatsOp op);
+  ~StatsTimer ();
+  StatsOp op;
+  std::chrono::steady_clock::time_point start;
+};
+
+#define STATS_KERNEL(k, len) statsKernel(k, len)
+#define STATS_SCRATCH(digits) statsScratch(digits)
+#define STATS_DEPTH() StatsDepth statsDepth
+#define STATS_OP(op) StatsTimer statsTimer (op)
+
+#else
+
+#define STATS_KERNEL(k, len) ((void)0)
+#define STATS_SCRATCH(digits) ((void)0)
+#define STATS_DEPTH() ((void)0)
+#define STATS_OP(op) ((void)0)
+
+#endif // POSINT_STATS
+
+#endif // STATS_H
@@ -0,0 +1,119 @@
+#include "threadpool.h"
+#include "posint.h"
+
+using namespace std;
+
+// The pool and queue index of the worker running on this thread
+static thread_local const ThreadPool* currentPool = NULL;
+static thread_local int currentIndex = 0;
+
+/******************** THREAD POOL ********************/
+
+ThreadPool::ThreadPool (int threads) :pending(0), stopping(false), waiting(0) {
+  if (threads < 0)
+    throw MPError("Thread pool can't have a negative number of threads");
+  if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+
+  for (int i=0; i <= threads; ++i) queues.push_back(new Queue);
+  for (int i=0; i < threads; ++i)
+    workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool () {
+  {
+    lock_guard<mutex> guard(sleepLock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (int i=0; i < workers.size(); ++i) workers[i].join();
+  for (int i=0; i < queues.size(); ++i) delete queues[i];
+}
+
+int ThreadPool::selfIndex () const {
+  return currentPool == this ? currentIndex : size();
+}
+
+void ThreadPool::push (const Task& task) {
+  Queue* q = queues[selfIndex()];
+  {
+    lock_guard<mutex> guard(q->lock);
+    q->tasks.push_back(task);
+  }
+  bool waiters;
+  {
+    lock_guard<mutex> guard(sleepLock);
+    ++pending;
+    waiters = waiting > 0;
+  }
+  wake.notify_one();
+  if (waiters) done.notify_all();
+}
+
+bool ThreadPool::runOne (int self) {
+  Task task;
+  bool found = false;
+
+  // Newest task from our own queue first
+  {
+    Queue* q = queues[self];
+    lock_guard<mutex> guard(q->lock);
+    if (!q->tasks.empty()) {
+      task = q->tasks.back();
+      q->tasks.pop_back();
+      found = true;
+    }
+  }
+
+  // Otherwise steal the oldest task from someone else
+  for (int i=1; !found && i < queues.size(); ++i) {
+    Queue* q = queues[(self + i) % queues.size()];
+    lock_guard<mutex> guard(q->lock);
+    if (!q->tasks.empty()) {
+      task = q->tasks.front();
+      q->tasks.pop_front();
+      found = true;
+    }
+  }
+
+  if (!found) return false;
+  --pending;
+  task.fn();
+  // The group may be gone once outstanding reaches 0, so don't touch it
+  if (--task.group->outstanding == 0) {
+    lock_guard<mutex> guard(sleepLock);
+    done.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::workerLoop (int index) {
+  currentPool = this;
+  currentIndex = index;
+  while (true) {
+    if (runOne(index)) continue;
+    unique_lock<mutex> guard(sleepLock);
+    wake.wait(guard, [this] { return pending > 0 || stopping; });
+    if (stopping) return;
+  }
+}
+
+/******************** TASK GROUPS ********************/
+
+void TaskGroup::run (const function<void()>& fn) {
+  ++outstanding;
+  ThreadPool::Task task;
+  task.fn = fn;
+  task.group = this;
+  pool.push(task);
+}
+
+void TaskGroup::wait () {
+  int self = pool.selfIndex();
+  while (outstanding > 0) {
+    if (pool.runOne(self)) continue;
+    unique_lock<mutex> guard(pool.sleepLock);
+    ++pool.waiting;
+    pool.done.wait(guard, [this] { return outstanding == 0 || pool.pending > 0; });
+    --pool.waiting;
+  }
+}
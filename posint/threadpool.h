@@ -0,0 +1,105 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+/* A pool of worker threads with work stealing.
+ * Each worker has its own queue of tasks. A worker pushes the tasks
+ * it spawns onto the back of its own queue and pops from there too,
+ * so it works depth-first on the most recent (and smallest) subproblem.
+ * An idle worker steals from the front of another queue, which holds
+ * the oldest (and largest) tasks. Tasks submitted from outside the
+ * pool go on a separate shared queue.
+ *
+ * Tasks are run through a TaskGroup, and must not throw.
+ */
+class ThreadPool {
+  public:
+    // Starts a pool with the given number of workers, or one per
+    // hardware thread if threads is 0.
+    explicit ThreadPool (int threads = 0);
+    ~ThreadPool ();
+
+    // Returns the number of worker threads
+    int size () const { return workers.size(); }
+
+  private:
+    friend class TaskGroup;
+
+    struct Task {
+      std::function<void()> fn;
+      TaskGroup* group;
+    };
+
+    struct Queue {
+      std::mutex lock;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    // One queue per worker, then the shared queue for outside threads
+    std::vector<Queue*> queues;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::atomic<int> pending;
+    std::atomic<bool> stopping;
+
+    // Threads blocked in TaskGroup::wait sleep on done, which is
+    // signalled when a group finishes or a task is queued while any
+    // of them are waiting (counted in waiting, under sleepLock).
+    std::condition_variable done;
+    int waiting;
+
+    // Returns this thread's queue index in this pool, or size()
+    // if the calling thread is not one of its workers.
+    int selfIndex () const;
+
+    // Queues a task from the calling thread
+    void push (const Task& task);
+
+    // Runs one queued task, preferring the queue at index self.
+    // Returns false if no task was found.
+    bool runOne (int self);
+
+    void workerLoop (int index);
+
+    ThreadPool (const ThreadPool&);
+    ThreadPool& operator= (const ThreadPool&);
+};
+
+/* A set of tasks run on a ThreadPool that can be waited for together.
+ * While waiting, the calling thread runs queued tasks itself, so it is
+ * safe to wait from inside another task. When there are none left to
+ * run, it sleeps until the group finishes or more tasks are queued.
+ */
+class TaskGroup {
+  public:
+    explicit TaskGroup (ThreadPool& p) :pool(p), outstanding(0) { }
+    ~TaskGroup () { wait(); }
+
+    // Queues fn to run on the pool
+    void run (const std::function<void()>& fn);
+
+    // Returns once every task in this group has finished
+    void wait ();
+
+  private:
+    friend class ThreadPool;
+
+    ThreadPool& pool;
+    std::atomic<int> outstanding;
+
+    TaskGroup (const TaskGroup&);
+    TaskGroup& operator= (const TaskGroup&);
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,173 @@
+/* Measures the crossover points between the multiplication,
+ * division and GCD algorithms on this machine, and writes them to
+ * standard output in the form of tuning.h. Run it through "make tune".
+ */
+#include <iostream>
+#include <string>
+#include <climits>
+#include <ctime>
+#include <cstdlib>
+#include "posint.h"
+using namespace std;
+
+// Sets x to a random number of (at most) len digits
+static void randomDigits (PosInt& x, int len) {
+  PosInt::setBase(16);
+  string allF (16*len, 'F');
+  PosInt bound (allF.c_str());
+  x.rand(bound);
+}
+
+// Sets a and b to operands of the given length for the operation
+// being tuned: two of that length for a product or a GCD, or a divisor
+// of that length and a dividend twice as long for a division.
+static void randomOperands 
+  (const PosInt::MulThresholds&, PosInt& a, PosInt& b, int len)
+{
+  randomDigits(a, len);
+  randomDigits(b, len);
+}
+
+static void randomOperands 
+  (const PosInt::GcdThresholds&, PosInt& a, PosInt& b, int len)
+{
+  randomDigits(a, len);
+  randomDigits(b, len);
+}
+
+static void randomOperands 
+  (const PosInt::DivThresholds&, PosInt& a, PosInt& b, int len)
+{
+  randomDigits(a, 2*len);
+  randomDigits(b, len);
+}
+
+// Does the operation being tuned once: a product a * b, a
+// division of a by b, or their GCD.
+static void runOp (const PosInt::MulThresholds&, const PosInt& a, const PosInt& b) {
+  PosInt c(a);
+  c.mul(b);
+}
+
+static void runOp (const PosInt::DivThresholds&, const PosInt& a, const PosInt& b) {
+  PosInt q, r;
+  PosInt::divrem(q, r, a, b);
+}
+
+static void runOp (const PosInt::GcdThresholds&, const PosInt& a, const PosInt& b) {
+  PosInt g;
+  g.gcd(a, b);
+}
+
+static void setThresholds (const PosInt::MulThresholds& t) {
+  PosInt::setMulThresholds(t);
+}
+
+static void setThresholds (const PosInt::DivThresholds& t) {
+  PosInt::setDivThresholds(t);
+}
+
+static void setThresholds (const PosInt::GcdThresholds& t) {
+  PosInt::setGcdThresholds(t);
+}
+
+// Returns the best time, in seconds, for a single operation on
+// a and b under the current thresholds.
+template <class Thresholds>
+static double timeOp (const Thresholds& t, const PosInt& a, const PosInt& b) {
+  double best = 1e30;
+  for (int trial = 0; trial < 5; ++trial) {
+    int reps = 0;
+    clock_t start = clock();
+    clock_t stop;
+    do {
+      runOp(t, a, b);
+      ++reps;
+    } while ((stop = clock()) - start < CLOCKS_PER_SEC / 100);
+    double each = double(stop - start) / CLOCKS_PER_SEC / reps;
+    if (each < best) best = each;
+  }
+  return best;
+}
+
+// Finds the smallest length, between lo and hi, at which setting the
+// given threshold to that length is faster than leaving it just above,
+// for two sizes in a row. The thresholds in t are otherwise unchanged.
+template <class Thresholds>
+static int findThreshold 
+  (Thresholds& t, int Thresholds::* which, const char* name, int lo, int hi)
+{
+  int wins = 0;
+  int first = hi;
+  for (int len = lo; len < hi; len += max(1, len/10)) {
+    PosInt a, b;
+    randomOperands(t, a, b, len);
+
+    t.*which = len;
+    setThresholds(t);
+    double newtime = timeOp(t, a, b);
+    t.*which = len + 1;
+    setThresholds(t);
+    double oldtime = timeOp(t, a, b);
+
+    cerr << name << " " << len << ": " << newtime << " vs " << oldtime << endl;
+    if (newtime < oldtime) {
+      if (wins++ == 0) first = len;
+      if (wins == 2) break;
+    }
+    else wins = 0;
+  }
+  if (wins < 2) first = hi;
+  t.*which = first;
+  setThresholds(t);
+  return first;
+}
+
+int main() {
+  srand(time(NULL));
+
+  PosInt::MulThresholds t;
+  t.karatsuba = INT_MAX;
+  t.toom3 = INT_MAX;
+  t.toom4 = INT_MAX;
+  t.ntt = INT_MAX;
+
+  findThreshold(t, &PosInt::MulThresholds::karatsuba, "karatsuba", 4, 400);
+  findThreshold(t, &PosInt::MulThresholds::toom3, "toom3", 
+                max(7, t.karatsuba), 4000);
+  findThreshold(t, &PosInt::MulThresholds::toom4, "toom4", 
+                max(13, t.toom3), 8000);
+  findThreshold(t, &PosInt::MulThresholds::ntt, "ntt", 
+                t.toom4, 100000);
+
+  PosInt::DivThresholds d;
+  d.burnikelZiegler = INT_MAX;
+  d.newton = INT_MAX;
+
+  findThreshold(d, &PosInt::DivThresholds::burnikelZiegler, "bz", 4, 1000);
+  // Newton's method only pays off once products are much cheaper
+  // than Burnikel-Ziegler's recursion, so start looking at Toom-4 sizes
+  findThreshold(d, &PosInt::DivThresholds::newton, "newton", 
+                max(d.burnikelZiegler, t.toom4), 200000);
+
+  PosInt::GcdThresholds g;
+  g.hgcd = INT_MAX;
+
+  findThreshold(g, &PosInt::GcdThresholds::hgcd, "hgcd", 20, 4000);
+
+  cout << "/* Multiplication, division and GCD thresholds for PosInt, in digits.\n"
+       << " * This file is written by \"make tune\", which measures the\n"
+       << " * crossover points between the algorithms on this machine.\n"
+       << " */\n"
+       << "#ifndef TUNING_H\n"
+       << "#define TUNING_H\n\n"
+       << "#define KARATSUBA_THRESHOLD " << t.karatsuba << "\n"
+       << "#define TOOM3_THRESHOLD " << t.toom3 << "\n"
+       << "#define TOOM4_THRESHOLD " << t.toom4 << "\n"
+       << "#define NTT_THRESHOLD " << t.ntt << "\n"
+       << "#define BZ_THRESHOLD " << d.burnikelZiegler << "\n"
+       << "#define NEWTON_THRESHOLD " << d.newton << "\n"
+       << "#define HGCD_THRESHOLD " << g.hgcd << "\n\n"
+       << "#endif // TUNING_H\n";
+  return 0;
+}
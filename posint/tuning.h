@@ -0,0 +1,16 @@
+/* Multiplication, division and GCD thresholds for PosInt, in digits.
+ * This file is written by "make tune", which measures the
+ * crossover points between the algorithms on this machine.
+ */
+#ifndef TUNING_H
+#define TUNING_H
+
+#define KARATSUBA_THRESHOLD 33
+#define TOOM3_THRESHOLD 196
+#define TOOM4_THRESHOLD 550
+#define NTT_THRESHOLD 58289
+#define BZ_THRESHOLD 16
+#define NEWTON_THRESHOLD 63000
+#define HGCD_THRESHOLD 200
+
+#endif // TUNING_H